@@ -13,53 +13,48 @@
 #include <libconfig.h>
 #include <pcre.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "openqm_httpd_server.h"
 
 // Types
 
-struct openqm_req_data_struct {
-   char *auth_type;
-   char *hostname;
-   char *header_in;
-   char *query_string;
-   char *remote_info;
-   char *remote_user;
-   char *method;
-   char *uri;
-   char *server_info;
-};
-
-struct openqm_resp_data_struct {
-   char *http_output;
-   char  http_status [4];
-   char *header_out;
-};
-
 struct headerin_info_struct {
-   char **ptr_headerin_dynarray;
-   bool   error_status;
+   struct dynarray_builder_struct headerin_builder;
+   bool                           error_status;
 };
 
 struct querystring_info_struct {
-   char                          **ptr_querystring_dynarray;
+   struct dynarray_builder_struct  querystring_builder;
    unsigned int                    http_error;
    struct connection_info_struct  *connection_info;
 };
 
 // Declaration
 
-static bool add_key_value_2dynarray (char **dynarray, const char *key, const char *value);
 static int iterate_post (void *postinfo_cls, enum MHD_ValueKind kind, const char *key, const char *filename, const char *content_type, const char *transfer_encoding, const char *data, uint64_t off, size_t size);
+static unsigned int check_content_length (struct MHD_Connection *connection, size_t max_body, const char **content_length);
+static unsigned int raw_body_init (struct post_info_struct *post_info, const char *content_length, size_t max_body);
+static bool raw_body_append (struct post_info_struct *post_info, const char *data, size_t size, size_t max_body);
 static int iterate_header (void *headerininfo_cls, enum MHD_ValueKind kind, const char *key, const char *value);
 static int iterate_querystring (void *querystringinfo_cls, enum MHD_ValueKind kind, const char *key, const char *value);
 static void request_completed (void *cls, struct MHD_Connection *connection, void **postinfo_cls, enum MHD_RequestTerminationCode toe);
-static unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, struct MHD_Connection *connection, struct connection_info_struct *connection_info, const char *url, const char *method);
+static void openqm_call_job (void *connection_info_cls);
+static struct MHD_Response *openqm_make_response (struct connection_info_struct *connection_info, unsigned int *http_return_code);
+static unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, struct MHD_Connection *connection, struct connection_info_struct *connection_info);
 static bool openqm_init_resp (struct openqm_resp_data_struct *openqm_resp_data);
-static struct MHD_Response *make_default_error_page (struct MHD_Connection *connection, unsigned int status_code);
-static int ohs_send_response (struct MHD_Connection *connection, unsigned int http_return_code, struct MHD_Response *response);
+static bool cache_key_build (struct connection_info_struct *connection_info, struct MHD_Connection *connection);
+static int header_out_split (struct connection_info_struct *connection_info, struct header_out_struct **header_outs);
+static char *compress_body (struct connection_info_struct *connection_info, struct header_out_struct *header_outs, int *header_out_length, size_t *body_length);
+static char *dynarray_next_value (char *dynarray_value);
+static struct MHD_Response *make_default_error_page (struct connection_info_struct *connection_info, unsigned int status_code);
+static void request_phase_end (struct connection_info_struct *connection_info, enum request_phase_enum request_phase);
+static void server_timing_add (struct connection_info_struct *connection_info, struct MHD_Response *response);
+static void slow_request_log (struct connection_info_struct *connection_info);
+static int ohs_send_response (struct connection_info_struct *connection_info, unsigned int http_return_code, struct MHD_Response *response);
 static int openqm_to_connection (void *cls, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **postinfo_cls);
 
 // Globals constants
@@ -72,56 +67,37 @@ static const size_t querystring_max_size = 16384;
 static const char procotol_http [] = "http";
 static const char procotol_https [] = "https";
 static const size_t post_buffer_size = post_max_size / 32;
-static const char common_error_page [] = "<html><head><title>Error</title></head><body><p>%s</p></body></html>";
+static const size_t raw_body_initial_size = 4096;
+static const char header_out_directive [] = "X-OHS-";
+static const char header_out_continue [] = "X-OHS-Continue";
+static const char header_out_sendfile [] = "X-OHS-Sendfile";
+static const char header_out_sendfile_delete [] = "X-OHS-Sendfile-Delete";
+static const char header_out_cache_purge [] = "X-OHS-Cache-Purge";
+static const char *request_phase_names [rp_count] = {
+   "routing",
+   "receiving",
+   "marshaling",
+   "queued",
+   "connecting",
+   "calling",
+   "responding",
+   "sending"
+};
 
 // Functions
 
 void abort_message (const char* error_message)
 {
-   // Only add the error message in log
-   syslog (LOG_USER | LOG_ERR, "%s", error_message);
-#ifdef OHS_DEBUG
-   printf ("abort_message : %s\n", error_message);
-#endif
+   // Only add the error message in log, a flood of the same message is cut
+   if (ohs_log_rate_allow (error_message)) {
+      ohs_log (LOG_ERR, "%s", error_message);
+   }
 }
 
-bool add_key_value_2dynarray (char **dynarray,
-                              const char *key,
-                              const char *value)
+bool ohs_header_out_directive (const char *header_out_field)
 {
-   int mv_key;
-   if (QMLocate (key, *dynarray, 1, 1, 0, &mv_key, "AL")) {
-      if (value != NULL && strlen (value) != 0) {
-         char* new_dynarray;
-         char* old_value = QMExtract (*dynarray, 2, mv_key, 0);
-         if (old_value) {
-            char* new_value = realloc (old_value, strlen (old_value) + strlen (value) + 1);
-            if (new_value == NULL) {
-               QMFree (old_value);
-               return false;
-            }
-            strcat (new_value, value);
-            new_dynarray = QMReplace (*dynarray, 2, mv_key, 0, new_value);
-            free (new_value);
-         }
-         else
-         {
-            new_dynarray = QMReplace (*dynarray, 2, mv_key, 0, value);
-         }
-         QMFree (*dynarray);
-         *dynarray = new_dynarray;
-      }
-   }
-   else
-   {
-      char* new_dynarray = QMIns (*dynarray, 1, mv_key, 0, key);
-      QMFree (*dynarray);
-      *dynarray = new_dynarray;
-      new_dynarray = QMIns (*dynarray, 2, mv_key, 0, value == NULL ? "" : value);
-      QMFree (*dynarray);
-      *dynarray = new_dynarray;
-   }
-   return true;
+   // The X-OHS- headers are directives for the server
+   return strncasecmp (header_out_field, header_out_directive, sizeof (header_out_directive) - 1) == 0;
 }
 
 int iterate_post (void *postinfo_cls,
@@ -135,19 +111,99 @@ int iterate_post (void *postinfo_cls,
                   size_t size)
 {
    struct post_info_struct *post_info = postinfo_cls;
-   size_t new_len = strlen (post_info->post_dynarray) + strlen (key) + strlen(data) + 1;
+
+   // Files are written to disk, only their description is kept in memory
+   if (filename != NULL && config_http_upload_dir != NULL) {
+      if (!ohs_upload_write (post_info, key, content_type, data, off, size)) {
+         post_info->error_status = true;
+         return MHD_NO;
+      }
+      return MHD_YES;
+   }
+
+   size_t new_len = dynarray_builder_length (&post_info->post_builder) + strlen (key) + size + 2;
 
    if (new_len > post_max_size) {
       post_info->error_status = true;
       return MHD_NO;
    }
-   if (!add_key_value_2dynarray (&post_info->post_dynarray, key, data)) {
+   // A large value is received in several parts, they are concatenated
+   if (!dynarray_builder_add (&post_info->post_builder, key, data, size)) {
       post_info->error_status = true;
       return MHD_NO;
    }
    return MHD_YES;
 }
 
+unsigned int check_content_length (struct MHD_Connection *connection, size_t max_body, const char **content_length)
+{
+   // Checked before any byte of the body is read
+   *content_length = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+   if (*content_length != NULL) {
+      char *content_length_end;
+      unsigned long long body_length = strtoull (*content_length, &content_length_end, 10);
+
+      if (**content_length == '\0' || *content_length_end != '\0') {
+         abort_message ("Invalid Content-Length");
+         return MHD_HTTP_BAD_REQUEST;
+      }
+      if (body_length > max_body) {
+         abort_message ("Request body too large");
+         return MHD_HTTP_PAYLOAD_TOO_LARGE;
+      }
+   }
+   return 0;
+}
+
+unsigned int raw_body_init (struct post_info_struct *post_info, const char *content_length, size_t max_body)
+{
+   // With Content-Length the body is copied once in a buffer of its size
+   size_t raw_body_size = raw_body_initial_size;
+
+   if (content_length != NULL) {
+      raw_body_size = strtoull (content_length, NULL, 10) + 1;
+   }
+   else if (raw_body_size > max_body + 1) {
+      raw_body_size = max_body + 1;
+   }
+   post_info->raw_body = ohs_arena_alloc (post_info->post_builder.arena, raw_body_size);
+   if (post_info->raw_body == NULL) {
+      abort_message ("Full memory when receiving request body");
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
+   post_info->raw_body_size = raw_body_size;
+   return 0;
+}
+
+bool raw_body_append (struct post_info_struct *post_info, const char *data, size_t size, size_t max_body)
+{
+   // Chunked body, the buffer grows until the maximum body size
+   if (post_info->raw_body_length + size >= post_info->raw_body_size) {
+      size_t new_size = post_info->raw_body_size * 2;
+
+      while (new_size <= post_info->raw_body_length + size) {
+         new_size *= 2;
+      }
+      if (new_size > max_body + 1) {
+         new_size = max_body + 1;
+      }
+
+      char *new_raw_body = ohs_arena_alloc (post_info->post_builder.arena, new_size);
+
+      if (new_raw_body == NULL) {
+         abort_message ("Full memory when receiving request body");
+         post_info->http_error = MHD_HTTP_INTERNAL_SERVER_ERROR;
+         return false;
+      }
+      memcpy (new_raw_body, post_info->raw_body, post_info->raw_body_length);
+      post_info->raw_body = new_raw_body;
+      post_info->raw_body_size = new_size;
+   }
+   memcpy (post_info->raw_body + post_info->raw_body_length, data, size);
+   post_info->raw_body_length += size;
+   return true;
+}
+
 int iterate_header (void *headerininfo_cls,
                     enum MHD_ValueKind kind,
                     const char *key,
@@ -156,13 +212,14 @@ int iterate_header (void *headerininfo_cls,
    // Ignore Host header pass in hostname
    if (strcasecmp (key, "host") != 0) {
       struct headerin_info_struct *headerin_info = headerininfo_cls;
-      size_t new_len = strlen (*headerin_info->ptr_headerin_dynarray) + strlen (key) + strlen (value) + 1;
+      size_t value_length = value == NULL ? 0 : strlen (value);
+      size_t new_len = dynarray_builder_length (&headerin_info->headerin_builder) + strlen (key) + value_length + 2;
 
       if (new_len > headerin_max_size) {
          headerin_info->error_status = true;
          return MHD_NO;
       }
-      if (!add_key_value_2dynarray (headerin_info->ptr_headerin_dynarray, key, value)) {
+      if (!dynarray_builder_add (&headerin_info->headerin_builder, key, value, value_length)) {
          headerin_info->error_status = true;
          return MHD_NO;
       }
@@ -176,7 +233,8 @@ int iterate_querystring (void *querystringinfo_cls,
                          const char *value)
 {
    struct querystring_info_struct *querystring_info = querystringinfo_cls;
-   size_t new_len = strlen (*querystring_info->ptr_querystring_dynarray) + strlen (key) + (value == NULL ? 0 : strlen (value)) + 1;
+   size_t value_length = value == NULL ? 0 : strlen (value);
+   size_t new_len = dynarray_builder_length (&querystring_info->querystring_builder) + strlen (key) + value_length + 2;
 
    if (!check_get_param_authorized (key, querystring_info->connection_info)) {
       char error_message_detail [256];
@@ -191,7 +249,7 @@ int iterate_querystring (void *querystringinfo_cls,
       querystring_info->http_error = MHD_HTTP_BAD_REQUEST;
       return MHD_NO;
    }
-   if (!add_key_value_2dynarray (querystring_info->ptr_querystring_dynarray, key, value)) {
+   if (!dynarray_builder_add (&querystring_info->querystring_builder, key, value, value_length)) {
       abort_message ("Full memory when retreive query string");
       querystring_info->http_error = MHD_HTTP_INTERNAL_SERVER_ERROR;
       return MHD_NO;
@@ -206,86 +264,277 @@ void request_completed (void *cls,
 {
    struct connection_info_struct *connection_info = *connection_info_cls;
 
-#ifdef OHS_DEBUG
-   printf ("Start request_completed\n");
-#endif
+   ohs_log_debug ("Start request_completed");
    if (connection_info != NULL) {
-      if (connection_info->post_info != NULL) {
-         if (connection_info->post_info->connection_type == ct_post) {
-            MHD_destroy_post_processor (connection_info->post_info->post_processor);
-            if (connection_info->post_info->post_dynarray) {
-               free (connection_info->post_info->post_dynarray);
-            }
-         }
-         free (connection_info->post_info);
+      request_phase_end (connection_info, rp_sending);
+      if (config_http_slow_request > 0 && connection_info->phase_time - connection_info->start_time >= config_http_slow_request * 1000ul) {
+         slow_request_log (connection_info);
+      }
+      ohs_accesslog_request (connection_info);
+      ohs_metrics_request (connection_info->route == NULL ? 0 : connection_info->route->metrics_index, connection_info->http_status, connection_info->phase_time - connection_info->start_time, connection_info->post_info == NULL ? 0 : connection_info->post_info->body_length);
+      ohs_flight_cancel (connection_info);
+      if (connection_info->post_info != NULL && connection_info->post_info->connection_type == ct_post) {
+         MHD_destroy_post_processor (connection_info->post_info->post_processor);
+         ohs_upload_cleanup (connection_info->post_info);
+      }
+      if (connection_info->openqm_resp_data.http_output != NULL) {
+         ohs_buffer_release (bp_http_output, connection_info->openqm_resp_data.http_output);
+      }
+      if (connection_info->openqm_resp_data.header_out != NULL) {
+         ohs_buffer_release (bp_header_out, connection_info->openqm_resp_data.header_out);
       }
-      free (connection_info);
+      // All the other request data, connection_info included, are in the arena
+      ohs_arena_release (connection_info->arena);
       *connection_info_cls = NULL;
    }
-#ifdef OHS_DEBUG
-   printf ("End request_completed\n");
-#endif
+   ohs_log_debug ("End request_completed");
 }
 
-unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, struct MHD_Connection *connection, struct connection_info_struct *connection_info, const char *url, const char *method)
+void openqm_call_job (void *connection_info_cls)
 {
-   // Initialise to null QM string
-   openqm_req_data->header_in = malloc (1);
-   if (openqm_req_data->header_in == NULL) {
-      abort_message ("Full memory to initialize input buffer");
-      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   // Executed by the executor thread while the connection is suspended
+   struct connection_info_struct *connection_info = connection_info_cls;
+   struct openqm_req_data_struct *openqm_req_data = &connection_info->openqm_req_data;
+   struct openqm_resp_data_struct *openqm_resp_data = &connection_info->openqm_resp_data;
+   int pool_index;
+
+   request_phase_end (connection_info, rp_queued);
+   pool_index = ohs_pool_acquire ();
+   request_phase_end (connection_info, rp_connecting);
+   if (pool_index < 0) {
+      connection_info->call_return_code = MHD_HTTP_SERVICE_UNAVAILABLE;
    }
-   *openqm_req_data->header_in = '\0';
-   openqm_req_data->query_string = malloc (1);
-   if (openqm_req_data->query_string == NULL) {
-      abort_message ("Full memory to initialize input buffer");
-      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   else {
+      ohs_log_debug ("Calling to OpenQM with pool session %d", pool_index);
+      QMCall (connection_info->subr, 
+              13,
+              openqm_req_data->auth_type,                // 1
+              openqm_req_data->hostname,                 // 2
+              openqm_req_data->header_in,                // 3
+              openqm_req_data->query_string,             // 4
+              connection_info->post_info->post_dynarray, // 5
+              openqm_req_data->remote_info,              // 6
+              openqm_req_data->remote_user,              // 7
+              openqm_req_data->method,                   // 8
+              openqm_req_data->uri,                      // 9
+              openqm_req_data->server_info,              // 10
+              openqm_resp_data->http_output,             // 11
+              openqm_resp_data->http_status,             // 12
+              openqm_resp_data->header_out               // 13
+              );
+      request_phase_end (connection_info, rp_calling);
+      ohs_metrics_qmcall (connection_info->phase_durations [rp_calling]);
+
+      ohs_log_debug ("OpenQM call return");
+      ohs_pool_release (pool_index);
+      connection_info->call_return_code = 0;
    }
-   *openqm_req_data->query_string = '\0';
-   openqm_req_data->server_info = malloc (1);
-   if (openqm_req_data->server_info == NULL) {
-      abort_message ("Full memory to initialize input buffer");
-      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   connection_info->call_state = cs_called;
+   MHD_resume_connection (connection_info->connection);
+}
+
+struct MHD_Response *openqm_make_response (struct connection_info_struct *connection_info, unsigned int *http_return_code)
+{
+   struct openqm_resp_data_struct *openqm_resp_data = &connection_info->openqm_resp_data;
+   struct MHD_Response *response = NULL;
+
+   // Check if the routine update the status
+   if (strcmp (openqm_resp_data->http_status, "*3") == 0) {
+      char error_message_detail [256];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "The routine %s didn't update http status", connection_info->subr);
+      abort_message (error_message_detail);
+      *http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+      return NULL;
    }
-   *openqm_req_data->server_info = '\0';
 
-   // Copy string
-   openqm_req_data->method = strdup (method);
-   openqm_req_data->uri = strdup (url);
-   if (openqm_req_data->method == NULL || openqm_req_data->uri == NULL) {
-      abort_message ("Full memory when copying request data");
-      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   // Return status
+   *http_return_code = atoi (openqm_resp_data->http_status);
+   if (!*http_return_code) {
+      *http_return_code = MHD_HTTP_OK;
+   }
+
+   // Headers out, the directives for the server aren't sent to the client
+   struct header_out_struct *header_outs;
+   int header_out_length = header_out_split (connection_info, &header_outs);
+   const char *continue_handle = NULL;
+   const char *sendfile_name = NULL;
+   bool sendfile_delete = false;
+
+   if (header_out_length < 0) {
+      *http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+      return NULL;
+   }
+   for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+      const char *header_out_field = header_outs [header_out_index].field;
+      const char *header_out_value = header_outs [header_out_index].value;
+
+      if (*header_out_value == '\0') {
+         continue;
+      }
+      if (strcasecmp (header_out_field, header_out_continue) == 0) {
+         continue_handle = header_out_value;
+      }
+      else if (strcasecmp (header_out_field, header_out_sendfile) == 0) {
+         sendfile_name = header_out_value;
+      }
+      else if (strcasecmp (header_out_field, header_out_sendfile_delete) == 0) {
+         sendfile_delete = strcmp (header_out_value, "0") != 0;
+      }
+      else if (strcasecmp (header_out_field, header_out_cache_purge) == 0) {
+         // Responses made stale by the routine
+         ohs_cache_purge (header_out_value);
+      }
+   }
+   if (continue_handle != NULL && config_openqm_continue_subr == NULL) {
+      char error_message_detail [256];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "The routine %s returned a continuation but openqm.continue_subr isn't configured", connection_info->subr);
+      abort_message (error_message_detail);
+      continue_handle = NULL;
+   }
+
+   if (sendfile_name != NULL) {
+      // Page in a file, http_output is ignored and released with the request
+      response = ohs_sendfile_create_response (sendfile_name, sendfile_delete, &connection_info->response_body_length);
+   }
+   else if (continue_handle != NULL) {
+      // Larger than http_output, the next parts are sent as they are fetched
+      response = ohs_stream_create_response (connection_info->connection, continue_handle, openqm_resp_data->http_output);
+      if (response != NULL) {
+         openqm_resp_data->http_output = NULL;
+      }
+   }
+   else {
+      // Complete web page, MHD gives back the buffer to its pool
+      char *body = openqm_resp_data->http_output;
+      size_t body_length = strlen (body);
+      MHD_ContentReaderFreeCallback body_free = &ohs_http_output_free;
+
+      if (connection_info->route->etag && *http_return_code == MHD_HTTP_OK) {
+         bool etag_found = false;
+
+         for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+            etag_found |= strcasecmp (header_outs [header_out_index].field, MHD_HTTP_HEADER_ETAG) == 0;
+         }
+
+         // Without ETag from the routine, the hash of the body
+         char *etag = etag_found ? NULL : ohs_arena_alloc (connection_info->arena, OHS_ETAG_SIZE);
+
+         if (etag != NULL) {
+            ohs_etag_compute (body, body_length, etag);
+            header_outs [header_out_length].field = MHD_HTTP_HEADER_ETAG;
+            header_outs [header_out_length].value = etag;
+            ++header_out_length;
+         }
+      }
+
+      char *compressed = connection_info->route->compress ? compress_body (connection_info, header_outs, &header_out_length, &body_length) : NULL;
+
+      if (compressed != NULL) {
+         // The compressed copy is sent, http_output goes back to its pool now
+         ohs_buffer_release (bp_http_output, openqm_resp_data->http_output);
+         openqm_resp_data->http_output = NULL;
+         body = compressed;
+         body_free = &free;
+      }
+      response = MHD_create_response_from_buffer_with_free_callback (body_length, body, body_free);
+      if (response != NULL) {
+         ohs_metrics_response_body (body_length);
+         connection_info->response_body_length = body_length;
+         if (connection_info->cache_key != NULL && connection_info->route->cache_ttl > 0 && ohs_cache_cacheable (*http_return_code, header_outs, header_out_length)) {
+            ohs_cache_store (connection_info->cache_key, connection_info->cache_key_length, connection_info->route->cache_ttl, *http_return_code, body, body_length, header_outs, header_out_length);
+         }
+         openqm_resp_data->http_output = NULL;
+         connection_info->response_shared = true;
+      }
+      else if (compressed != NULL) {
+         free (compressed);
+      }
+   }
+   if (response == NULL) {
+      *http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+      return NULL;
    }
 
+   for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+      if (!ohs_header_out_directive (header_outs [header_out_index].field)) {
+         MHD_add_response_header (response, header_outs [header_out_index].field, header_outs [header_out_index].value);
+      }
+      ohs_log_debug ("Header out %s=%s", header_outs [header_out_index].field, header_outs [header_out_index].value);
+   }
+   ohs_buffer_release (bp_header_out, openqm_resp_data->header_out);
+   openqm_resp_data->header_out = NULL;
+   return response;
+}
+
+unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, struct MHD_Connection *connection, struct connection_info_struct *connection_info)
+{
+   // The method and the uri are copied with the creation of connection_info
+
    // Request hostname
    const char *header_hostname = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, "Host");
    if (header_hostname != NULL) {
-      openqm_req_data->hostname = strdup (header_hostname);
+      openqm_req_data->hostname = ohs_arena_strdup (connection_info->arena, header_hostname);
    }
 
    // Process headers in
    struct headerin_info_struct headerin_info;
-   headerin_info.ptr_headerin_dynarray = &openqm_req_data->header_in;
+   dynarray_builder_init (&headerin_info.headerin_builder, connection_info->arena);
    headerin_info.error_status = false;
    MHD_get_connection_values (connection, MHD_HEADER_KIND, &iterate_header, &headerin_info);
    if (headerin_info.error_status) {
+      dynarray_builder_free (&headerin_info.headerin_builder);
+      abort_message ("Full memory when copying header in");
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
+   openqm_req_data->header_in = dynarray_builder_finish (&headerin_info.headerin_builder);
+   if (openqm_req_data->header_in == NULL) {
       abort_message ("Full memory when copying header in");
       return MHD_HTTP_INTERNAL_SERVER_ERROR;
    }
 
    // Retreive data from GET method
    struct querystring_info_struct querystring_info;
-   querystring_info.ptr_querystring_dynarray = &openqm_req_data->query_string;
+   dynarray_builder_init (&querystring_info.querystring_builder, connection_info->arena);
    querystring_info.http_error = 0;
    querystring_info.connection_info = connection_info;
    MHD_get_connection_values (connection, MHD_GET_ARGUMENT_KIND, &iterate_querystring, &querystring_info);
    if (querystring_info.http_error) {
+      dynarray_builder_free (&querystring_info.querystring_builder);
       return querystring_info.http_error;
    }
+   openqm_req_data->query_string = dynarray_builder_finish (&querystring_info.querystring_builder);
+   if (openqm_req_data->query_string == NULL) {
+      abort_message ("Full memory when retreive query string");
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+   // Post data received
+   struct post_info_struct *post_info = connection_info->post_info;
+   if (post_info->connection_type == ct_raw) {
+      // Passed as is, without key/value parsing. QMCall only takes C
+      // strings, a NUL byte would cut off the body silently
+      if (memchr (post_info->raw_body, '\0', post_info->raw_body_length) != NULL) {
+         abort_message ("Request body contains a NUL byte");
+         return MHD_HTTP_BAD_REQUEST;
+      }
+      post_info->raw_body [post_info->raw_body_length] = '\0';
+      post_info->post_dynarray = post_info->raw_body;
+   }
+   else if (!ohs_upload_finish (post_info)) {
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
+   else {
+      post_info->post_dynarray = dynarray_builder_finish (&post_info->post_builder);
+   }
+   if (post_info->post_dynarray == NULL) {
+      abort_message ("Full memory when receiving post data");
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
 
    // Remote info (IP address ":" Port)
-   openqm_req_data->remote_info = malloc(1);
-   openqm_req_data->remote_info[0] = '\0';
+   openqm_req_data->remote_info = ohs_arena_strdup (connection_info->arena, "");
    /* TODO
    MHD_OPTION_NOTIFY_CONNECTION
    MHD_get_connection_info (, MHD_CONNECTION_INFO_SOCKET_CONTEXT, );
@@ -322,7 +571,7 @@ unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, st
 
    // Authentication type and remove user
    // TODO basic and digest authentication
-   openqm_req_data->auth_type = strdup ("NONE");
+   openqm_req_data->auth_type = ohs_arena_strdup (connection_info->arena, "NONE");
    if (openqm_req_data->auth_type == NULL) {
       abort_message ("Full memory when extract remove user");
       return MHD_HTTP_INTERNAL_SERVER_ERROR;
@@ -336,7 +585,15 @@ unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, st
    else {
       protocol_name = procotol_https;
    }
-   if (!add_key_value_2dynarray (&openqm_req_data->server_info, "protocol", protocol_name)) {
+   struct dynarray_builder_struct serverinfo_builder;
+   dynarray_builder_init (&serverinfo_builder, connection_info->arena);
+   if (!dynarray_builder_add (&serverinfo_builder, "protocol", protocol_name, strlen (protocol_name))) {
+      dynarray_builder_free (&serverinfo_builder);
+      abort_message ("Full memory when retreiving server info");
+      return MHD_HTTP_INTERNAL_SERVER_ERROR;
+   }
+   openqm_req_data->server_info = dynarray_builder_finish (&serverinfo_builder);
+   if (openqm_req_data->server_info == NULL) {
       abort_message ("Full memory when retreiving server info");
       return MHD_HTTP_INTERNAL_SERVER_ERROR;
    }
@@ -346,92 +603,252 @@ unsigned int openqm_init_req (struct openqm_req_data_struct *openqm_req_data, st
 
 bool openqm_init_resp (struct openqm_resp_data_struct *openqm_resp_data)
 {
-   openqm_resp_data->http_output = malloc (65536);
+   // Output buffers are reused from a pool, "*n" gives their size to QMCall
+   openqm_resp_data->http_output = ohs_buffer_acquire (bp_http_output);
    if (!openqm_resp_data->http_output) {
       abort_message ("Full memory to initialize output buffer");
       return false;
    }
-   strcpy (openqm_resp_data->http_output, "*65535");
-   openqm_resp_data->header_out = malloc (16384);
+   sprintf (openqm_resp_data->http_output, "*%zu", ohs_buffer_size (bp_http_output) - 1);
+   openqm_resp_data->header_out = ohs_buffer_acquire (bp_header_out);
    if (!openqm_resp_data->header_out) {
       abort_message ("Full memory to initialize output buffer");
       return false;
    }
-   strcpy (openqm_resp_data->header_out, "*16383");
+   sprintf (openqm_resp_data->header_out, "*%zu", ohs_buffer_size (bp_header_out) - 1);
    return true;
 }
 
-struct MHD_Response *make_default_error_page (struct MHD_Connection *connection,
-                                               unsigned int status_code)
+bool cache_key_build (struct connection_info_struct *connection_info, struct MHD_Connection *connection)
 {
-   struct MHD_Response *response = NULL;
-   //char *error_page = NULL;
-   char error_message [256];
+   // Host, uri, query string (sorted) or the cache_param values, the
+   // cache_header values and the content encoding, separated by marks
+   const struct route_node_struct *route = connection_info->route;
+   struct openqm_req_data_struct *openqm_req_data = &connection_info->openqm_req_data;
+   const char *content_encoding_name = ohs_compress_encoding_name (connection_info->content_encoding);
+   size_t key_size = strlen (openqm_req_data->hostname) + strlen (openqm_req_data->uri) + strlen (content_encoding_name) + 5;
+
+   if (route->cache_param_length < 0) {
+      key_size += strlen (openqm_req_data->query_string);
+   }
+   for (int param_index = 0 ; param_index < route->cache_param_length ; ++param_index) {
+      const char *param_value = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, route->cache_param [param_index]);
 
-#ifdef OHS_DEBUG
-   printf ("Default error page %u\n", status_code);
-#endif
+      key_size += (param_value == NULL ? 0 : strlen (param_value)) + 1;
+   }
+   for (int header_index = 0 ; header_index < route->cache_header_length ; ++header_index) {
+      const char *header_value = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, route->cache_header [header_index]);
 
-   switch (status_code) {
-      case MHD_HTTP_BAD_REQUEST:           // 400
-         strcpy (error_message, "Bad request");
-         break;
-      case MHD_HTTP_NOT_FOUND:             // 404
-         strcpy (error_message, "Page not found");
-         break;
-      case MHD_HTTP_METHOD_NOT_ALLOWED:    // 405
-         strcpy (error_message, "Method not allowed");
-         break;
-      case MHD_HTTP_INTERNAL_SERVER_ERROR: // 500
-         strcpy (error_message, "Internal server error");
-         break;
-      case MHD_HTTP_SERVICE_UNAVAILABLE:   // 503
-         strcpy (error_message, "Service unavailable");
-         break;
-      default:
-         snprintf (error_message, sizeof (error_message), "Unknown error %u", status_code);
-         status_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
-         break;
+      key_size += (header_value == NULL ? 0 : strlen (header_value)) + 1;
+   }
+
+   char *cache_key = ohs_arena_alloc (connection_info->arena, key_size);
+
+   if (cache_key == NULL) {
+      abort_message ("Full memory when building cache key");
+      return false;
+   }
+
+   char *key_end = stpcpy (cache_key, openqm_req_data->hostname);
+
+   *key_end++ = FIELD_MARK;
+   key_end = stpcpy (key_end, openqm_req_data->uri);
+   *key_end++ = FIELD_MARK;
+   if (route->cache_param_length < 0) {
+      key_end = stpcpy (key_end, openqm_req_data->query_string);
+   }
+   for (int param_index = 0 ; param_index < route->cache_param_length ; ++param_index) {
+      const char *param_value = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, route->cache_param [param_index]);
+
+      key_end = stpcpy (key_end, param_value == NULL ? "" : param_value);
+      *key_end++ = VALUE_MARK;
+   }
+   *key_end++ = FIELD_MARK;
+   for (int header_index = 0 ; header_index < route->cache_header_length ; ++header_index) {
+      const char *header_value = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, route->cache_header [header_index]);
+
+      key_end = stpcpy (key_end, header_value == NULL ? "" : header_value);
+      *key_end++ = VALUE_MARK;
+   }
+   // Each encoding has its own response
+   *key_end++ = FIELD_MARK;
+   key_end = stpcpy (key_end, content_encoding_name);
+   connection_info->cache_key = cache_key;
+   connection_info->cache_key_length = key_end - cache_key;
+   return true;
+}
+
+int header_out_split (struct connection_info_struct *connection_info, struct header_out_struct **header_outs)
+{
+   // Names in attribute 1 and values in attribute 2 linked by multi-value.
+   // The dynamic array is split in place, the strings stay in header_out.
+   char *header_out_field = connection_info->openqm_resp_data.header_out;
+   char *header_out_value = strchr (header_out_field, FIELD_MARK);
+   int header_out_length = 0;
+   int header_out_size = 4;   // Three more for ETag, Vary and Content-Encoding added by the server
+
+   if (header_out_value != NULL) {
+      *header_out_value++ = '\0';
+      char *header_out_end = strchr (header_out_value, FIELD_MARK);
+      if (header_out_end != NULL) {
+         *header_out_end = '\0';
+      }
+   }
+   for (const char *value_mark = strchr (header_out_field, VALUE_MARK) ; value_mark != NULL ; value_mark = strchr (value_mark + 1, VALUE_MARK)) {
+      ++header_out_size;
+   }
+   *header_outs = ohs_arena_alloc (connection_info->arena, header_out_size * sizeof (struct header_out_struct));
+   if (*header_outs == NULL) {
+      abort_message ("Full memory when processing header out");
+      return -1;
+   }
+   while (*header_out_field != '\0') {
+      char *next_field = dynarray_next_value (header_out_field);
+      char *next_value = header_out_value == NULL ? NULL : dynarray_next_value (header_out_value);
+
+      (*header_outs) [header_out_length].field = header_out_field;
+      (*header_outs) [header_out_length].value = header_out_value == NULL ? "" : header_out_value;
+      ++header_out_length;
+      header_out_field = next_field;
+      header_out_value = next_value;
+   }
+   return header_out_length;
+}
+
+char *compress_body (struct connection_info_struct *connection_info, struct header_out_struct *header_outs, int *header_out_length, size_t *body_length)
+{
+   // Compressed copy of http_output in the negotiated encoding, NULL when
+   // it's sent as is
+   const char *content_type = NULL;
+   struct header_out_struct *etag_header_out = NULL;
+   bool content_encoded = false;
+
+   for (int header_out_index = 0 ; header_out_index < *header_out_length ; ++header_out_index) {
+      if (strcasecmp (header_outs [header_out_index].field, MHD_HTTP_HEADER_CONTENT_TYPE) == 0) {
+         content_type = header_outs [header_out_index].value;
+      }
+      else if (strcasecmp (header_outs [header_out_index].field, MHD_HTTP_HEADER_CONTENT_ENCODING) == 0) {
+         content_encoded = true;
+      }
+      else if (strcasecmp (header_outs [header_out_index].field, MHD_HTTP_HEADER_ETAG) == 0) {
+         etag_header_out = &header_outs [header_out_index];
+      }
+   }
+   if (content_encoded || !ohs_compress_content_type (content_type)) {
+      return NULL;
    }
 
-   char *page_to_send;
-   size_t page_length = sizeof (common_error_page) + strlen (error_message);
+   // The response depends on Accept-Encoding, even when it isn't compressed
+   header_outs [*header_out_length].field = MHD_HTTP_HEADER_VARY;
+   header_outs [*header_out_length].value = MHD_HTTP_HEADER_ACCEPT_ENCODING;
+   ++*header_out_length;
+   if (connection_info->content_encoding == ce_identity || *body_length < config_http_compress_min) {
+      return NULL;
+   }
+
+   size_t compressed_length;
+   char *compressed = ohs_compress (connection_info->content_encoding, connection_info->openqm_resp_data.http_output, *body_length, &compressed_length);
 
-   page_to_send = malloc (page_length);
-   if (! page_to_send) {
-      abort_message ("Full memory when generate default error page");
+   if (compressed == NULL) {
       return NULL;
    }
+   header_outs [*header_out_length].field = MHD_HTTP_HEADER_CONTENT_ENCODING;
+   header_outs [*header_out_length].value = ohs_compress_encoding_name (connection_info->content_encoding);
+   ++*header_out_length;
+   // Same content but not the same bytes, the ETag becomes weak
+   if (etag_header_out != NULL && strncmp (etag_header_out->value, "W/", 2) != 0) {
+      char *weak_etag = ohs_arena_alloc (connection_info->arena, strlen (etag_header_out->value) + 3);
+
+      if (weak_etag != NULL) {
+         stpcpy (stpcpy (weak_etag, "W/"), etag_header_out->value);
+         etag_header_out->value = weak_etag;
+      }
+   }
+   *body_length = compressed_length;
+   return compressed;
+}
 
-   snprintf (page_to_send, page_length, common_error_page, error_message);
-   response = MHD_create_response_from_buffer (strlen (page_to_send), page_to_send, MHD_RESPMEM_MUST_FREE);
-   if (response == NULL) {
-      abort_message ("Can't create buffer for default error page");
+char *dynarray_next_value (char *dynarray_value)
+{
+   // Terminate the current value and return the next one, only the first
+   // sub-value is kept
+   char *value_end = strchr (dynarray_value, VALUE_MARK);
+   char *subvalue_end = strchr (dynarray_value, SUBVALUE_MARK);
+
+   if (subvalue_end != NULL && (value_end == NULL || subvalue_end < value_end)) {
+      *subvalue_end = '\0';
    }
-   else {
-      MHD_add_response_header (response, "Content-type", "text/html; charset=utf-8");
+   if (value_end == NULL) {
+      return dynarray_value + strlen (dynarray_value);
    }
-   return response;
+   *value_end = '\0';
+   return value_end + 1;
+}
+
+struct MHD_Response *make_default_error_page (struct connection_info_struct *connection_info,
+                                               unsigned int status_code)
+{
+   // Shared by the requests except for the unknown statuses
+   ohs_log_debug ("Default error page %u", status_code);
+   ohs_metrics_error_page (status_code);
+   return ohs_error_response (connection_info->connection, connection_info->arena, status_code, &connection_info->response_body_length);
+}
+
+void request_phase_end (struct connection_info_struct *connection_info, enum request_phase_enum request_phase)
+{
+   // A phase can be run several times, its durations are added
+   unsigned long phase_time = ohs_metrics_clock ();
+
+   connection_info->phase_durations [request_phase] += phase_time - connection_info->phase_time;
+   connection_info->phase_time = phase_time;
+}
+
+void server_timing_add (struct connection_info_struct *connection_info, struct MHD_Response *response)
+{
+   // Phases up to the response, in milliseconds
+   char server_timing [512];
+   size_t server_timing_length = 0;
+
+   for (int request_phase = rp_routing ; request_phase < rp_sending ; ++request_phase) {
+      server_timing_length += snprintf (server_timing + server_timing_length, sizeof (server_timing) - server_timing_length, "%s%s;dur=%.3f", request_phase == rp_routing ? "" : ", ", request_phase_names [request_phase], connection_info->phase_durations [request_phase] / 1000.0);
+   }
+   MHD_add_response_header (response, "Server-Timing", server_timing);
+}
+
+void slow_request_log (struct connection_info_struct *connection_info)
+{
+   char phase_detail [512];
+   size_t phase_detail_length = 0;
+
+   for (int request_phase = rp_routing ; request_phase < rp_count ; ++request_phase) {
+      phase_detail_length += snprintf (phase_detail + phase_detail_length, sizeof (phase_detail) - phase_detail_length, " %s=%.1f", request_phase_names [request_phase], connection_info->phase_durations [request_phase] / 1000.0);
+   }
+   ohs_log (LOG_WARNING, "Slow request %.1f ms %s %s subr=%s status=%u,%s",
+           (connection_info->phase_time - connection_info->start_time) / 1000.0,
+           connection_info->openqm_req_data.method == NULL ? "-" : connection_info->openqm_req_data.method,
+           connection_info->openqm_req_data.uri == NULL ? "-" : connection_info->openqm_req_data.uri,
+           connection_info->subr == NULL ? "-" : connection_info->subr,
+           connection_info->http_status,
+           phase_detail);
 }
 
-int ohs_send_response (struct MHD_Connection *connection, unsigned int http_return_code, struct MHD_Response *response)
+int ohs_send_response (struct connection_info_struct *connection_info, unsigned int http_return_code, struct MHD_Response *response)
 {
+   struct MHD_Connection *connection = connection_info->connection;
    int return_status = MHD_NO;
 
    if (response != NULL) {
-#ifdef OHS_DEBUG
-      printf ("Before queue response\n");
-#endif
+      connection_info->http_status = http_return_code;
+      ohs_log_debug ("Before queue response");
       return_status = MHD_queue_response (connection,
                                           http_return_code,
                                           response);
-#ifdef OHS_DEBUG
-      printf ("After queue response\n");
-#endif
-      MHD_destroy_response (response);
-#ifdef OHS_DEBUG
-      printf ("After destroy response\n");
-#endif
+      ohs_log_debug ("After queue response");
+      ohs_response_destroy (response);
+      ohs_log_debug ("After destroy response");
+   }
+   else {
+      connection_info->response_body_length = OHS_BODY_LENGTH_UNKNOWN;
    }
    return return_status;
 }
@@ -449,75 +866,159 @@ int openqm_to_connection (void *cls,
    struct MHD_Response *response = NULL;
 
    if (*connection_info_cls == NULL) {
+      struct ohs_arena_struct *arena = ohs_arena_acquire ();
       struct connection_info_struct *connection_info;
 
-      connection_info = malloc (sizeof (struct connection_info_struct));
+      connection_info = arena == NULL ? NULL : ohs_arena_alloc (arena, sizeof (struct connection_info_struct));
       if (connection_info == NULL) {
          abort_message ("Full memory when initialize a connection");
+         if (arena != NULL) {
+            ohs_arena_release (arena);
+         }
          return MHD_NO;
       }
+      connection_info->arena = arena;
+      connection_info->connection = connection;
       connection_info->post_info = NULL;
       connection_info->subr = NULL;
-      connection_info->method_authorized_length = -1;
-      connection_info->method_authorized = NULL;
-      connection_info->get_param_authorized_length = -1;
-      connection_info->get_param_authorized = NULL;
+      connection_info->route = NULL;
+      connection_info->call_state = cs_receiving;
+      connection_info->call_return_code = 0;
+      connection_info->cache_key = NULL;
+      connection_info->cache_key_length = 0;
+      connection_info->flight = NULL;
+      connection_info->flight_next = NULL;
+      connection_info->response_shared = false;
+      connection_info->content_encoding = ce_identity;
+      connection_info->start_time = ohs_metrics_clock ();
+      connection_info->phase_time = connection_info->start_time;
+      memset (connection_info->phase_durations, 0, sizeof (connection_info->phase_durations));
+      connection_info->http_status = 0;
+      connection_info->response_body_length = OHS_BODY_LENGTH_UNKNOWN;
+      connection_info->call_job.job_function = &openqm_call_job;
+      connection_info->call_job.job_cls = connection_info;
+      connection_info->call_job.next = NULL;
+      connection_info->openqm_req_data.auth_type = NULL;
+      connection_info->openqm_req_data.hostname = NULL;
+      connection_info->openqm_req_data.header_in = NULL;
+      connection_info->openqm_req_data.query_string = NULL;
+      connection_info->openqm_req_data.remote_info = NULL;
+      connection_info->openqm_req_data.remote_user = NULL;
+      connection_info->openqm_req_data.server_info = NULL;
+      connection_info->openqm_resp_data.http_output = NULL;
+      strcpy (connection_info->openqm_resp_data.http_status, "*3");
+      connection_info->openqm_resp_data.header_out = NULL;
       *connection_info_cls = (void *) connection_info;
+      // Now for the access log of the requests refused before the routine
+      connection_info->openqm_req_data.method = ohs_arena_strdup (arena, method);
+      connection_info->openqm_req_data.uri = ohs_arena_strdup (arena, url);
+      if (connection_info->openqm_req_data.method == NULL || connection_info->openqm_req_data.uri == NULL) {
+         abort_message ("Full memory when copying request data");
+         return MHD_NO;
+      }
+
+      // Scraping and administration are answered without routine
+      if (config_http_metrics_path != NULL && strcmp (url, config_http_metrics_path) == 0) {
+         return ohs_metrics_handle (connection_info);
+      }
+      if (ohs_admin_url (url)) {
+         return ohs_admin_handle (connection_info, url, method);
+      }
 
       http_return_code = extract_subroutine_name_from_url (url, connection_info);
       if (http_return_code != 0) {
-         response = make_default_error_page (connection, http_return_code);
-         return ohs_send_response (connection, http_return_code, response);
+         response = make_default_error_page (connection_info, http_return_code);
+         return ohs_send_response (connection_info, http_return_code, response);
       }
 
       if (!check_method_authorized (method, connection_info)) {
          http_return_code = MHD_HTTP_METHOD_NOT_ALLOWED;
-         response = make_default_error_page (connection, http_return_code);
-         return ohs_send_response (connection, http_return_code, response);
+         response = make_default_error_page (connection_info, http_return_code);
+         return ohs_send_response (connection_info, http_return_code, response);
+      }
+
+      const char *content_length = NULL;
+
+      if (strcmp (method, "GET") != 0) {
+         http_return_code = check_content_length (connection, connection_info->route->max_body, &content_length);
+         if (http_return_code != 0) {
+            response = make_default_error_page (connection_info, http_return_code);
+            return ohs_send_response (connection_info, http_return_code, response);
+         }
       }
 
       struct post_info_struct *post_info;
 
-      post_info = malloc (sizeof (struct post_info_struct));
+      post_info = ohs_arena_alloc (connection_info->arena, sizeof (struct post_info_struct));
       if (post_info == NULL) {
          abort_message ("Full memory when initialize post data structure");
          return MHD_NO;
       }
       connection_info->post_info = post_info;
+      dynarray_builder_init (&post_info->post_builder, connection_info->arena);
       post_info->post_dynarray = NULL;
+      post_info->first_upload = NULL;
+      post_info->last_upload = NULL;
+      post_info->raw_body = NULL;
+      post_info->raw_body_length = 0;
+      post_info->raw_body_size = 0;
+      post_info->body_length = 0;
       post_info->post_processor = NULL;
+      post_info->http_error = 0;
       post_info->error_status = false;
-
-      // OpenQM empty string
-      post_info->post_dynarray = malloc (1);
-      if (post_info->post_dynarray == NULL) {
-         return MHD_NO;
-      }
-      post_info->post_dynarray[0] = '\0';
       if (strcmp (method, "GET") == 0) {
          post_info->connection_type = ct_get;
       }
       else {
-         post_info->connection_type = ct_post;
          post_info->post_processor = MHD_create_post_processor (connection,
                                                                 post_buffer_size,
                                                                 iterate_post,
                                                                 (void *) post_info);
-         if (post_info->post_processor == NULL) {
-            free (post_info->post_dynarray);
-            free (post_info);
-            return MHD_NO;
+         if (post_info->post_processor != NULL) {
+            post_info->connection_type = ct_post;
+         }
+         else {
+            // Not a form (JSON, XML...), MHD can't parse it
+            post_info->connection_type = ct_raw;
+            http_return_code = raw_body_init (post_info, content_length, connection_info->route->max_body);
+            if (http_return_code != 0) {
+               response = make_default_error_page (connection_info, http_return_code);
+               return ohs_send_response (connection_info, http_return_code, response);
+            }
          }
       }
+      request_phase_end (connection_info, rp_routing);
       return MHD_YES;
    }
 
    struct connection_info_struct *connection_info = *connection_info_cls;
 
-   if (connection_info->post_info->connection_type == ct_post && *upload_data_size != 0) {
-      MHD_post_process (connection_info->post_info->post_processor,
-                        upload_data,
-                        *upload_data_size);
+   if (connection_info->post_info == NULL) {
+      // Already answered by the first call (error, administration), the
+      // body is ignored
+      *upload_data_size = 0;
+      return MHD_YES;
+   }
+   if (connection_info->post_info->connection_type != ct_get && *upload_data_size != 0) {
+      struct post_info_struct *post_info = connection_info->post_info;
+
+      // Chunked body or body longer than announced, cut off at the limit.
+      // MHD can't queue the 413 before the whole body is received, it's sent
+      // by the last call
+      post_info->body_length += *upload_data_size;
+      if (post_info->body_length > connection_info->route->max_body && post_info->http_error == 0) {
+         abort_message ("Request body too large");
+         post_info->http_error = MHD_HTTP_PAYLOAD_TOO_LARGE;
+      }
+      // After an error the end of the body is ignored
+      if (post_info->http_error == 0 && post_info->connection_type == ct_post) {
+         MHD_post_process (post_info->post_processor,
+                           upload_data,
+                           *upload_data_size);
+      }
+      else if (post_info->http_error == 0) {
+         raw_body_append (post_info, upload_data, *upload_data_size, connection_info->route->max_body);
+      }
       *upload_data_size = 0;
 
       return MHD_YES;
@@ -526,6 +1027,11 @@ int openqm_to_connection (void *cls,
       abort_message ("Full memory when receiving post data");
       return MHD_NO;
    }
+   if (connection_info->post_info->http_error != 0) {
+      http_return_code = connection_info->post_info->http_error;
+      response = make_default_error_page (connection_info, http_return_code);
+      return ohs_send_response (connection_info, http_return_code, response);
+   }
 
    /*
     * 1 AUTH.TYPE -> MHD_basic_auth_get_username_password, MHD_digest_auth_get_username, certificat?
@@ -577,152 +1083,144 @@ int openqm_to_connection (void *cls,
     * 13 HTTP.HEADER (out)
     */
 
-#ifdef OHS_DEBUG
-   printf ("Starting\n");
-#endif
-
-   struct openqm_req_data_struct openqm_req_data;
-   struct openqm_resp_data_struct openqm_resp_data;
-
-   openqm_req_data.auth_type = NULL;
-   openqm_req_data.hostname = NULL;
-   openqm_req_data.header_in = NULL;
-   openqm_req_data.query_string = NULL;
-   openqm_req_data.remote_info = NULL;
-   openqm_req_data.remote_user = NULL;
-   openqm_req_data.method = NULL;
-   openqm_req_data.uri = NULL;
-   openqm_req_data.server_info = NULL;
-   openqm_resp_data.http_output = NULL;
-   strcpy (openqm_resp_data.http_status, "*3");
-   openqm_resp_data.header_out = NULL;
-
-   http_return_code = openqm_init_req (&openqm_req_data, connection, connection_info, url, method);
-
-   if (http_return_code == 0 && openqm_init_resp (&openqm_resp_data)) {
-      if (openqm_req_data.hostname == NULL) {
+   ohs_log_debug ("Starting");
+
+   // Back from the executor, the routine has been called
+   if (connection_info->call_state == cs_called) {
+      http_return_code = connection_info->call_return_code;
+      if (http_return_code == 0) {
+         response = openqm_make_response (connection_info, &http_return_code);
+      }
+      if (response == NULL) {
+         response = make_default_error_page (connection_info, http_return_code);
+      }
+      request_phase_end (connection_info, rp_responding);
+      if (config_http_server_timing && response != NULL && !ohs_error_response_shared (response)) {
+         server_timing_add (connection_info, response);
+      }
+      if (connection_info->flight != NULL) {
+         return ohs_flight_land (connection_info, http_return_code, response, connection_info->response_shared);
+      }
+      if (response != NULL && strcmp (method, "GET") == 0) {
+         // 304 when the client has the same response
+         int return_status = ohs_etag_queue_response (connection, &http_return_code, &connection_info->response_body_length, response);
+
+         connection_info->http_status = http_return_code;
+         ohs_response_destroy (response);
+         return return_status;
+      }
+      return ohs_send_response (connection_info, http_return_code, response);
+   }
+
+   // Back from a flight, the response of the leader is sent
+   if (connection_info->call_state == cs_following) {
+      request_phase_end (connection_info, rp_queued);
+
+      int flight_status = ohs_flight_follow (connection_info);
+
+      if (flight_status >= 0) {
+         return flight_status;
+      }
+      // Not shared by the leader, the routine is called for this request
+      connection_info->call_state = cs_receiving;
+   }
+   else {
+      request_phase_end (connection_info, rp_receiving);
+      http_return_code = openqm_init_req (&connection_info->openqm_req_data, connection, connection_info);
+      if (http_return_code == 0 && connection_info->openqm_req_data.hostname == NULL) {
          abort_message ("Hostname not provided");
          http_return_code = MHD_HTTP_BAD_REQUEST;
       }
-      else if (!QMConnectLocal (config_openqm_account)) {
-         char error_message_detail [256];
 
-         snprintf (error_message_detail, sizeof (error_message_detail), "Can't connect to OpenQM account %s: %s", config_openqm_account, QMError ());
-         abort_message (error_message_detail);
-         http_return_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+      // Encoding of the response, negotiated now because it selects the
+      // response in cache
+      if (http_return_code == 0 && connection_info->route->compress) {
+         connection_info->content_encoding = ohs_compress_negotiate (connection);
       }
-      else {
-#ifdef OHS_DEBUG
-         printf ("Connected to OpenQM\n");
-#endif
-
-#ifdef OHS_DEBUG
-         printf ("Calling to OpenQM\n");
-#endif
-         QMCall (connection_info->subr, 
-                 13,
-                 openqm_req_data.auth_type,                 // 1
-                 openqm_req_data.hostname,                  // 2
-                 openqm_req_data.header_in,                 // 3
-                 openqm_req_data.query_string,              // 4
-                 connection_info->post_info->post_dynarray, // 5
-                 openqm_req_data.remote_info,               // 6
-                 openqm_req_data.remote_user,               // 7
-                 openqm_req_data.method,                    // 8
-                 openqm_req_data.uri,                       // 9
-                 openqm_req_data.server_info,               // 10
-                 openqm_resp_data.http_output,              // 11
-                 openqm_resp_data.http_status,              // 12
-                 openqm_resp_data.header_out                // 13
-                 );
-
-#ifdef OHS_DEBUG
-         printf ("OpenQM call return\n");
-#endif
-         QMDisconnect ();
-#ifdef OHS_DEBUG
-         printf ("Disconnected from OpenQM\n");
-#endif
-
-         // Check if the routine update the status
-         if (strcmp (openqm_resp_data.http_status, "*3") == 0) {
-            char error_message_detail [256];
-
-            snprintf (error_message_detail, sizeof (error_message_detail), "The routine %s didn't update http status", connection_info->subr);
-            abort_message (error_message_detail);
+
+      // Response in cache, the routine isn't called
+      if (http_return_code == 0 && (connection_info->route->cache_ttl > 0 || connection_info->route->coalesce) && strcmp (method, "GET") == 0) {
+         if (!cache_key_build (connection_info, connection)) {
             http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
          }
          else {
-            // Return status
-            http_return_code = atoi (openqm_resp_data.http_status);
-            if (!http_return_code) {
-               http_return_code = MHD_HTTP_OK;
-            }
+            int cache_status = connection_info->route->cache_ttl > 0 ? ohs_cache_serve (connection, connection_info->cache_key, connection_info->cache_key_length, &connection_info->http_status, &connection_info->response_body_length) : -1;
 
-            // Complete web page
-            response = MHD_create_response_from_buffer (strlen (openqm_resp_data.http_output), openqm_resp_data.http_output, MHD_RESPMEM_MUST_FREE);
-            if (response == NULL) {
-               http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            else {
-               openqm_resp_data.http_output = NULL;
+            if (cache_status >= 0) {
+               return cache_status;
             }
-
-            // Process headers out
-            char* header_out_fields = QMExtract (openqm_resp_data.header_out, 1, 0, 0);
-            char* header_out_values = QMExtract (openqm_resp_data.header_out, 2, 0, 0);
-            int field_numbers_hout = QMDcount (header_out_fields, FIELD_MARK_STRING);
-
-            for (int field_number = 0 ; field_number < field_numbers_hout ; field_number++) 
-            {
-               char* temp_field = QMExtract (header_out_fields, 1, field_number + 1, 1);
-               char* temp_value = QMExtract (header_out_values, 1, field_number + 1, 1);
-               MHD_add_response_header (response, temp_field, temp_value);
-#ifdef OHS_DEBUG
-               printf ("Header out %s=%s\n", temp_field, temp_value);
-#endif
-               QMFree (temp_field);
-               QMFree (temp_value);
+            // The same request is already calling the routine, its response is awaited
+            if (connection_info->route->coalesce && ohs_flight_join (connection_info)) {
+               return MHD_YES;
             }
-            QMFree (header_out_fields);
-            QMFree (header_out_values);
          }
       }
    }
+
+   request_phase_end (connection_info, rp_marshaling);
+   if (http_return_code == 0 && openqm_init_resp (&connection_info->openqm_resp_data)) {
+      // The connection is suspended until the executor has called the routine
+      connection_info->call_state = cs_queued;
+      if (ohs_executor_submit (&connection_info->call_job, connection)) {
+         return MHD_YES;
+      }
+      connection_info->call_state = cs_receiving;
+      http_return_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+   }
    else { // if (init_req && init_resp
       if (http_return_code == 0) {
          http_return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
       }
    }
-   QMFree (openqm_req_data.header_in);
-   QMFree (openqm_req_data.query_string);
-   QMFree (openqm_req_data.server_info);
-   if (openqm_req_data.method) {
-      free (openqm_req_data.method);
-   }
-   if (openqm_req_data.uri) {
-      free (openqm_req_data.uri);
+
+   response = make_default_error_page (connection_info, http_return_code);
+   return ohs_send_response (connection_info, http_return_code, response);
+}
+
+struct MHD_Daemon *ohs_start_daemon (int listen_fd)
+{
+   // Tuning from the httpd section, only the options configured are given
+   struct MHD_OptionItem daemon_options [6];
+   int option_length = 0;
+   unsigned int daemon_flags = MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME;
+
+   if (config_http_use_epoll) {
+      daemon_flags |= MHD_USE_EPOLL_INTERNAL_THREAD;
    }
-   if (openqm_req_data.hostname) {
-      free (openqm_req_data.hostname);
+   else if (config_http_use_poll) {
+      daemon_flags |= MHD_USE_POLL_INTERNAL_THREAD;
    }
-   if (openqm_req_data.remote_info) {
-      free (openqm_req_data.remote_info);
+   if (config_http_thread_pool_size > 1) {
+      daemon_options [option_length++] = (struct MHD_OptionItem) {MHD_OPTION_THREAD_POOL_SIZE, config_http_thread_pool_size, NULL};
    }
-   if (openqm_req_data.auth_type) {
-      free (openqm_req_data.auth_type);
+   if (config_http_connection_limit > 0) {
+      daemon_options [option_length++] = (struct MHD_OptionItem) {MHD_OPTION_CONNECTION_LIMIT, config_http_connection_limit, NULL};
    }
-   if (openqm_resp_data.http_output) {
-      free (openqm_resp_data.http_output);
+   if (config_http_per_ip_connection_limit > 0) {
+      daemon_options [option_length++] = (struct MHD_OptionItem) {MHD_OPTION_PER_IP_CONNECTION_LIMIT, config_http_per_ip_connection_limit, NULL};
    }
-   if (openqm_resp_data.header_out) {
-      free (openqm_resp_data.header_out);
+   if (config_http_connection_timeout > 0) {
+      daemon_options [option_length++] = (struct MHD_OptionItem) {MHD_OPTION_CONNECTION_TIMEOUT, config_http_connection_timeout, NULL};
    }
-
-   if (response == NULL) {
-      response = make_default_error_page (connection, http_return_code);
+   if (config_http_connection_memory_limit > 0) {
+      daemon_options [option_length++] = (struct MHD_OptionItem) {MHD_OPTION_CONNECTION_MEMORY_LIMIT, config_http_connection_memory_limit, NULL};
    }
-   return ohs_send_response (connection, http_return_code, response);
+   daemon_options [option_length] = (struct MHD_OptionItem) {MHD_OPTION_END, 0, NULL};
+
+   return MHD_start_daemon (daemon_flags,
+                            config_http_port,
+                            NULL,                        // apc (check client)
+                            NULL,                        // apc_cls
+                            &openqm_to_connection,       // dh (handler for all url)
+                            NULL,                        // dh_cls
+                            MHD_OPTION_LISTEN_SOCKET,
+                            listen_fd,                   // Socket shared by all workers
+                            MHD_OPTION_NOTIFY_COMPLETED,
+                            &request_completed,          // Cleanup when completed
+                            NULL,
+                            MHD_OPTION_ARRAY,
+                            daemon_options,
+                            MHD_OPTION_END);
 }
 
 int main ()
@@ -734,27 +1232,37 @@ int main ()
       return 2;
    }
 
-   struct MHD_Daemon *daemon;
+   int listen_fd = ohs_listen_socket (config_http_port);
+   int unix_listen_fd = -1;
 
-   daemon = MHD_start_daemon (MHD_USE_INTERNAL_POLLING_THREAD,
-                              config_http_port,
-                              NULL,                        // apc (check client)
-                              NULL,                        // apc_cls
-                              &openqm_to_connection,       // dh (handler for all url)
-                              NULL,                        // dh_cls
-                              MHD_OPTION_NOTIFY_COMPLETED,
-                              &request_completed,          // Cleanup when completed
-                              NULL,
-                              MHD_OPTION_END);
-   if (daemon == NULL) {
+   // The unix socket is in addition to the TCP port, for the reverse proxy
+   if (listen_fd >= 0 && config_http_socket != NULL) {
+      unix_listen_fd = ohs_listen_unix_socket (config_http_socket, config_http_socket_mode);
+   }
+   if (listen_fd < 0 || (config_http_socket != NULL && unix_listen_fd < 0) || !ohs_cache_init () || !ohs_metrics_init () || !ohs_error_init ()) {
+      if (listen_fd >= 0) {
+         close (listen_fd);
+      }
+      if (unix_listen_fd >= 0) {
+         close (unix_listen_fd);
+         unlink (config_http_socket);
+      }
+      ohs_error_free ();
       ohs_config_free ();
+      config_destroy (&config_openqm_httpd_server);
       return 1;
    }
 
-   getchar ();
+   // Only return when the master receive SIGTERM or SIGINT
+   int exit_status = ohs_master_run (listen_fd, unix_listen_fd);
 
-   MHD_stop_daemon (daemon);
+   close (listen_fd);
+   if (unix_listen_fd >= 0) {
+      close (unix_listen_fd);
+      unlink (config_http_socket);
+   }
+   ohs_error_free ();
    config_destroy (&config_openqm_httpd_server);
    ohs_config_free ();
-   return 0;
+   return exit_status;
 }
@@ -1,27 +1,111 @@
 /*
  */
 
-#define OHS_DEBUG 1
+// Debug messages, only formatted at the debug level. OHS_NO_DEBUG_LOG
+// removes them from the executable.
+#ifdef OHS_NO_DEBUG_LOG
+#define ohs_log_debug(...) do { } while (0)
+#else
+#define ohs_log_debug(...) do { if (__builtin_expect (ohs_log_level >= LOG_DEBUG, 0)) ohs_log (LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
 
 // Types
 
 enum connection_type_enum {
    ct_post,
-   ct_get
+   ct_get,
+   ct_raw     // Body which isn't a form, passed as is
+};
+
+enum content_encoding_enum {
+   ce_identity,
+   ce_deflate,
+   ce_gzip,
+   ce_brotli
+};
+
+enum buffer_pool_enum {
+   bp_http_output,
+   bp_header_out,
+   bp_count
+};
+
+struct ohs_buffer_stats_struct {
+   unsigned long allocated;   // Buffers allocated, in use or free
+   unsigned long in_use;
+   unsigned long high_water;  // Maximum of in_use
+   unsigned long free_length;
+};
+
+struct dynarray_builder_struct {
+   struct ohs_arena_struct      *arena;
+   char                         *storage;
+   size_t                        storage_length;
+   size_t                        storage_size;
+   struct dynarray_entry_struct *entries;
+   size_t                        entry_length;
+   size_t                        entry_size;
 };
 
 struct post_info_struct
 {
    enum connection_type_enum connection_type;
+   struct dynarray_builder_struct post_builder;
    char *post_dynarray;
+   struct upload_file_struct *first_upload;
+   struct upload_file_struct *last_upload;
+   char *raw_body;
+   size_t raw_body_length;
+   size_t raw_body_size;
+   size_t body_length;   // Received, whatever the connection type
+   unsigned int http_error;
    bool error_status;
    struct MHD_PostProcessor *post_processor; 
 };
 
+struct openqm_req_data_struct {
+   char *auth_type;
+   char *hostname;
+   char *header_in;
+   char *query_string;
+   char *remote_info;
+   char *remote_user;
+   char *method;
+   char *uri;
+   char *server_info;
+};
+
+struct header_out_struct {
+   const char *field;
+   const char *value;
+};
+
+struct openqm_resp_data_struct {
+   char *http_output;
+   char  http_status [4];
+   char *header_out;
+};
+
+struct ohs_job_struct {
+   void                  (*job_function) (void *job_cls);
+   void                   *job_cls;
+   struct ohs_job_struct  *next;
+};
+
 struct url_config_struct {
    const char  *path;
    pcre        *pattern_comp;
+   pcre_extra  *pattern_extra;
    const char  *subr;
+   int          max_body;     // -1 when not configured
+   int          cache_ttl;    // Seconds, 0 without cache
+   int          coalesce;     // Boolean
+   int          etag;         // Boolean
+   int          compress;     // Boolean, -1 when not configured
+   int          cache_param_length;
+   const char **cache_param;
+   int          cache_header_length;
+   const char **cache_header;
    int          method_length;
    const char **method;
    int          get_param_length;
@@ -30,27 +114,241 @@ struct url_config_struct {
    struct url_config_struct *next;
 };
 
+// Phases of a request, timed to find where the slow requests spend their time
+enum request_phase_enum {
+   rp_routing,     // Headers received to route found
+   rp_receiving,   // Request body
+   rp_marshaling,  // Dynamic arrays of the routine parameters
+   rp_queued,      // Waiting for the executor or for the leader of a flight
+   rp_connecting,  // Session of the worker checked
+   rp_calling,     // QMCall
+   rp_responding,  // Response built from the routine output
+   rp_sending,     // Response queued to completed
+   rp_count
+};
+
+enum call_state_enum {
+   cs_receiving,
+   cs_queued,
+   cs_called,
+   cs_following   // Waiting for the response of an identical request
+};
+
+// Compiled routing table built from the url configuration
+
+#define OHS_METHOD_GET     0x01
+#define OHS_METHOD_POST    0x02
+#define OHS_METHOD_PUT     0x04
+#define OHS_METHOD_PATCH   0x08
+#define OHS_METHOD_DELETE  0x10
+#define OHS_METHOD_HEAD    0x20
+#define OHS_METHOD_OPTIONS 0x40
+#define OHS_METHOD_CONNECT 0x80
+#define OHS_METHOD_TRACE   0x100
+#define OHS_METHOD_ALL     0xFFFFFFFF
+
+// Body length of a response which isn't known when it's queued
+#define OHS_BODY_LENGTH_UNKNOWN ((size_t) -1)
+
+// Quoted 64 bits hash in hexadecimal
+#define OHS_ETAG_SIZE 19
+
+struct string_set_struct {
+   unsigned int  bucket_mask;
+   const char  **buckets;
+};
+
+struct route_literal_struct {
+   const char               *path;
+   size_t                    path_length;
+   unsigned int              hash;
+   struct route_node_struct *node;
+};
+
+struct route_pattern_struct {
+   pcre                     *pattern_comp;
+   pcre_extra               *pattern_extra;
+   struct route_node_struct *node;
+};
+
+struct route_node_struct {
+   const char                  *subr;          // Inherited from the upper levels
+   int                          metrics_index; // Of the subroutine
+   size_t                       max_body;      // Inherited from the upper levels
+   int                          cache_ttl;
+   int                          cache_param_length;  // -1 for the whole query string
+   const char                 **cache_param;
+   int                          cache_header_length;
+   const char                 **cache_header;
+   bool                         coalesce;
+   bool                         etag;          // ETag computed from the body
+   bool                         compress;      // Inherited from the upper levels
+   unsigned int                 method_mask;
+   struct string_set_struct    *get_param_set; // NULL when not controlled
+   unsigned int                 literal_mask;
+   struct route_literal_struct *literals;      // Hash table of path
+   int                          pattern_length;
+   struct route_pattern_struct *patterns;      // Ordered pattern fallbacks
+   bool                         has_sub_path;
+};
+
 struct connection_info_struct {
+   struct ohs_arena_struct *arena;
+   struct MHD_Connection   *connection;
    struct post_info_struct *post_info;
    const char              *subr;
-   int                      method_authorized_length;
-   const char             **method_authorized;
-   int                      get_param_authorized_length;
-   const char             **get_param_authorized;
+   const struct route_node_struct *route;
+   enum call_state_enum      call_state;
+   unsigned int              call_return_code;
+   char                     *cache_key;     // Only for the routes with a cache
+   size_t                    cache_key_length;
+   struct flight_struct     *flight;        // Leader or follower of a flight
+   struct connection_info_struct *flight_next;
+   bool                      response_shared; // Response which can be sent to the followers
+   enum content_encoding_enum content_encoding;
+   unsigned long             start_time;    // Microseconds, monotonic
+   unsigned long             phase_time;    // End of the last phase
+   unsigned long             phase_durations [rp_count];
+   unsigned int              http_status;   // Sent, 0 until a response is queued
+   size_t                    response_body_length; // Sent, OHS_BODY_LENGTH_UNKNOWN for a stream or before the response
+   struct ohs_job_struct     call_job;
+   struct openqm_req_data_struct  openqm_req_data;
+   struct openqm_resp_data_struct openqm_resp_data;
 };
 
 // Globals variables
 
 extern config_t config_openqm_httpd_server;
 extern const char *config_openqm_account;
+extern const char *config_openqm_continue_subr;
 extern int config_http_port;
+extern int config_http_workers;
+extern int config_http_buffer_pool_max;
+extern char *config_http_sendfile_dir;
+extern char *config_http_upload_dir;
+extern int config_http_max_body;
+extern size_t config_http_cache_max;
+extern const char *config_http_admin_path;
+extern const char *config_http_admin_token;
+extern const char *config_http_metrics_path;
+extern const char *config_http_metrics_token;
+extern const char *config_http_socket;
+extern mode_t config_http_socket_mode;
+extern int config_http_socket_admin;
+extern int config_http_thread_pool_size;
+extern int config_http_use_epoll;
+extern int config_http_use_poll;
+extern int config_http_connection_limit;
+extern int config_http_per_ip_connection_limit;
+extern int config_http_connection_timeout;
+extern int config_http_connection_memory_limit;
+extern int config_http_listen_backlog;
+extern int config_http_tcp_nodelay;
+extern int config_http_tcp_fastopen;
+extern int config_http_server_timing;
+extern int config_http_slow_request;
+extern const char *config_http_access_log;
+extern int config_http_access_log_entries;
+extern int config_http_log_rate_limit;
+extern const char *config_http_error_html;
+extern const char *config_http_error_json;
+extern const char *config_http_error_xml;
+extern volatile int ohs_log_level;
+extern int config_http_compress_min;
+extern int config_http_compress_level;
 extern struct url_config_struct *first_url_config;
 
 // Globals functions
 
 extern void abort_message (const char *error_message);
+extern int ohs_log_level_value (const char *level_name);
+extern void ohs_log_init (int level);
+extern void ohs_log_toggle ();
+extern void ohs_log (int level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+extern bool ohs_log_rate_allow (const char *message);
+extern void ohs_log_rate_flush ();
+extern bool ohs_header_out_directive (const char *header_out_field);
 extern bool ohs_config_read ();
 extern void ohs_config_free ();
 extern int extract_subroutine_name_from_url (const char *url, struct connection_info_struct *connection_info);
 extern bool check_method_authorized (const char *method, struct connection_info_struct *connection_info);
 extern bool check_get_param_authorized (const char *key, struct connection_info_struct *connection_info);
+extern size_t ohs_buffer_size (enum buffer_pool_enum pool_id);
+extern const char *ohs_buffer_pool_name (enum buffer_pool_enum pool_id);
+extern char *ohs_buffer_acquire (enum buffer_pool_enum pool_id);
+extern void ohs_buffer_release (enum buffer_pool_enum pool_id, char *buffer_memory);
+extern void ohs_http_output_free (void *buffer_memory);
+extern void ohs_buffer_stats (enum buffer_pool_enum pool_id, struct ohs_buffer_stats_struct *buffer_stats);
+extern void ohs_buffer_log_stats ();
+extern void ohs_buffer_free ();
+extern struct ohs_arena_struct *ohs_arena_acquire ();
+extern void *ohs_arena_alloc (struct ohs_arena_struct *arena, size_t size);
+extern char *ohs_arena_strndup (struct ohs_arena_struct *arena, const char *string, size_t string_length);
+extern char *ohs_arena_strdup (struct ohs_arena_struct *arena, const char *string);
+extern void ohs_arena_release (struct ohs_arena_struct *arena);
+extern void dynarray_builder_init (struct dynarray_builder_struct *dynarray_builder, struct ohs_arena_struct *arena);
+extern void dynarray_builder_free (struct dynarray_builder_struct *dynarray_builder);
+extern size_t dynarray_builder_length (const struct dynarray_builder_struct *dynarray_builder);
+extern bool dynarray_builder_add (struct dynarray_builder_struct *dynarray_builder, const char *key, const char *value, size_t value_length);
+extern char *dynarray_builder_finish (struct dynarray_builder_struct *dynarray_builder);
+extern unsigned int ohs_method_bit (const char *method);
+extern bool ohs_route_compile ();
+extern void ohs_route_free ();
+extern void ohs_pool_init ();
+extern int ohs_pool_acquire ();
+extern void ohs_pool_release (int pool_index);
+extern void ohs_pool_free ();
+extern struct MHD_Daemon *ohs_start_daemon (int listen_fd);
+extern int ohs_listen_socket (int port);
+extern int ohs_listen_unix_socket (const char *socket_path, mode_t socket_mode);
+extern int ohs_master_run (int listen_fd, int unix_listen_fd);
+extern struct MHD_Response *ohs_stream_create_response (struct MHD_Connection *connection, const char *handle, char *http_output);
+extern struct MHD_Response *ohs_sendfile_create_response (const char *file_name, bool delete_file, size_t *body_length);
+extern bool ohs_upload_write (struct post_info_struct *post_info, const char *key, const char *content_type, const char *data, uint64_t off, size_t size);
+extern bool ohs_upload_finish (struct post_info_struct *post_info);
+extern void ohs_upload_cleanup (struct post_info_struct *post_info);
+extern int ohs_cache_serve (struct MHD_Connection *connection, const char *key, size_t key_length, unsigned int *http_status, size_t *body_length);
+extern bool ohs_cache_cacheable (unsigned int http_status, const struct header_out_struct *header_outs, int header_out_length);
+extern void ohs_cache_store (const char *key, size_t key_length, int cache_ttl, unsigned int http_status, const char *body, size_t body_length, const struct header_out_struct *header_outs, int header_out_length);
+extern void ohs_cache_free ();
+extern bool ohs_cache_init ();
+extern unsigned long ohs_cache_purge (const char *pattern);
+extern bool ohs_admin_client_trusted (struct MHD_Connection *connection, const char *token);
+extern int ohs_admin_send_text (struct connection_info_struct *connection_info, unsigned int http_status, const char *text);
+extern bool ohs_admin_url (const char *url);
+extern int ohs_admin_handle (struct connection_info_struct *connection_info, const char *url, const char *method);
+extern bool ohs_flight_join (struct connection_info_struct *connection_info);
+extern int ohs_flight_land (struct connection_info_struct *connection_info, unsigned int http_status, struct MHD_Response *response, bool response_shared);
+extern int ohs_flight_follow (struct connection_info_struct *connection_info);
+extern void ohs_flight_cancel (struct connection_info_struct *connection_info);
+extern void ohs_etag_compute (const char *body, size_t body_length, char *etag);
+extern int ohs_etag_queue_response (struct MHD_Connection *connection, unsigned int *http_status, size_t *body_length, struct MHD_Response *response);
+extern enum content_encoding_enum ohs_compress_negotiate (struct MHD_Connection *connection);
+extern const char *ohs_compress_encoding_name (enum content_encoding_enum content_encoding);
+extern bool ohs_compress_content_type (const char *content_type);
+extern char *ohs_compress (enum content_encoding_enum content_encoding, const char *body, size_t body_length, size_t *compressed_length);
+extern int ohs_metrics_subr_index (const char *subr);
+extern bool ohs_metrics_init ();
+extern void ohs_metrics_worker (int worker_index);
+extern unsigned long ohs_metrics_clock ();
+extern void ohs_metrics_request (int subr_index, unsigned int http_status, unsigned long duration, size_t request_body_size);
+extern void ohs_metrics_response_body (size_t response_body_size);
+extern void ohs_metrics_qmcall (unsigned long duration);
+extern void ohs_metrics_qm_connect (unsigned long duration);
+extern void ohs_metrics_error_page (unsigned int http_status);
+extern void ohs_metrics_buffer (enum buffer_pool_enum pool_id, const struct ohs_buffer_stats_struct *buffer_stats);
+extern void ohs_metrics_cache_lookup (bool cache_hit);
+extern void ohs_metrics_cache_memory (size_t cache_memory);
+extern int ohs_metrics_handle (struct connection_info_struct *connection_info);
+extern bool ohs_accesslog_start (int worker_index);
+extern void ohs_accesslog_stop ();
+extern void ohs_accesslog_reopen ();
+extern void ohs_accesslog_request (const struct connection_info_struct *connection_info);
+extern bool ohs_error_init ();
+extern void ohs_error_free ();
+extern struct MHD_Response *ohs_error_response (struct MHD_Connection *connection, struct ohs_arena_struct *arena, unsigned int status_code, size_t *page_length);
+extern bool ohs_error_response_shared (const struct MHD_Response *response);
+extern void ohs_response_destroy (struct MHD_Response *response);
+extern bool ohs_executor_start ();
+extern bool ohs_executor_submit (struct ohs_job_struct *job, struct MHD_Connection *connection);
+extern void ohs_executor_stop ();
@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openqm_httpd_server.h"
+
+// Access log of httpd.access_log, one JSON object by line.
+// The MHD threads put the formatted line in a bounded ring without lock (one
+// sequence number by entry, the producers reserve an entry with a
+// compare-and-swap on the enqueue position). A thread of the worker drains
+// the ring in batches and writes them with O_APPEND, so the workers can
+// share the file. When the disk is too slow and the ring is full the line is
+// dropped and counted instead of blocking the request. SIGUSR1 reopens the
+// file after its rotation, the worker forwards it with ohs_accesslog_reopen.
+
+// Sizes
+
+#define ACCESSLOG_LINE_SIZE 1024
+#define ACCESSLOG_BATCH_SIZE 65536
+
+// Types
+
+struct accesslog_entry_struct {
+   unsigned long sequence;
+   size_t        line_length;
+   char          line [ACCESSLOG_LINE_SIZE];
+};
+
+// Declarations
+
+static bool accesslog_open ();
+static void accesslog_write (const char *batch, size_t batch_length);
+static size_t accesslog_escape (char *line, size_t line_size, const char *value);
+static void *accesslog_thread (void *arg);
+
+// Constants
+
+// Drain interval of the ring when it's empty
+static const struct timespec accesslog_interval = { 0, 100000000 };
+
+// Globals variables
+
+static volatile bool accesslog_reopen_requested = false;
+static struct accesslog_entry_struct *accesslog_ring = NULL;
+static unsigned long accesslog_mask = 0;
+static unsigned long accesslog_enqueue = 0;
+static unsigned long accesslog_dequeue = 0;
+static unsigned long accesslog_dropped = 0;
+static unsigned long accesslog_request_count = 0;
+static int accesslog_worker_index = 0;
+static int accesslog_fd = -1;
+static volatile bool accesslog_running = false;
+static pthread_t accesslog_thread_id;
+
+// Functions
+
+bool accesslog_open ()
+{
+   int new_fd = open (config_http_access_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+
+   if (new_fd < 0) {
+      char error_message_detail [512];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't open access log %s: %s", config_http_access_log, strerror (errno));
+      abort_message (error_message_detail);
+      return false;
+   }
+   if (accesslog_fd >= 0) {
+      close (accesslog_fd);
+   }
+   accesslog_fd = new_fd;
+   return true;
+}
+
+void accesslog_write (const char *batch, size_t batch_length)
+{
+   while (batch_length != 0) {
+      ssize_t written_length = write (accesslog_fd, batch, batch_length);
+
+      if (written_length < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+
+         char error_message_detail [512];
+
+         snprintf (error_message_detail, sizeof (error_message_detail), "Can't write access log %s: %s", config_http_access_log, strerror (errno));
+         abort_message (error_message_detail);
+         return;
+      }
+      batch += written_length;
+      batch_length -= written_length;
+   }
+}
+
+size_t accesslog_escape (char *line, size_t line_size, const char *value)
+{
+   // JSON string without the quotes, cut off when line is full
+   size_t line_length = 0;
+
+   if (value == NULL) {
+      value = "";
+   }
+   for (; *value != '\0' ; ++value) {
+      unsigned char value_char = *value;
+
+      if (value_char == '"' || value_char == '\\') {
+         if (line_length + 2 >= line_size) {
+            break;
+         }
+         line [line_length++] = '\\';
+         line [line_length++] = value_char;
+      }
+      else if (value_char < 0x20) {
+         if (line_length + 6 >= line_size) {
+            break;
+         }
+         line_length += snprintf (line + line_length, line_size - line_length, "\\u%04x", value_char);
+      }
+      else {
+         if (line_length + 1 >= line_size) {
+            break;
+         }
+         line [line_length++] = value_char;
+      }
+   }
+   line [line_length] = '\0';
+   return line_length;
+}
+
+void *accesslog_thread (void *arg)
+{
+   char *batch = malloc (ACCESSLOG_BATCH_SIZE);
+   bool running = true;
+
+   if (batch == NULL) {
+      abort_message ("Full memory when starting the access log");
+      return NULL;
+   }
+   while (running) {
+      // Read before draining so the last lines aren't forgotten at the stop
+      running = accesslog_running;
+      if (accesslog_reopen_requested) {
+         accesslog_reopen_requested = false;
+         accesslog_open ();
+      }
+
+      size_t batch_length = 0;
+
+      for (;;) {
+         struct accesslog_entry_struct *entry = &accesslog_ring [accesslog_dequeue & accesslog_mask];
+
+         if (__atomic_load_n (&entry->sequence, __ATOMIC_ACQUIRE) != accesslog_dequeue + 1) {
+            break;
+         }
+         if (batch_length + entry->line_length > ACCESSLOG_BATCH_SIZE) {
+            accesslog_write (batch, batch_length);
+            batch_length = 0;
+         }
+         memcpy (batch + batch_length, entry->line, entry->line_length);
+         batch_length += entry->line_length;
+         // Free for the lap after this one
+         __atomic_store_n (&entry->sequence, accesslog_dequeue + accesslog_mask + 1, __ATOMIC_RELEASE);
+         ++accesslog_dequeue;
+      }
+      if (batch_length != 0) {
+         accesslog_write (batch, batch_length);
+      }
+
+      unsigned long dropped = __atomic_exchange_n (&accesslog_dropped, 0, __ATOMIC_RELAXED);
+
+      if (dropped != 0) {
+         char error_message_detail [128];
+
+         snprintf (error_message_detail, sizeof (error_message_detail), "Access log full, %lu lines dropped", dropped);
+         abort_message (error_message_detail);
+      }
+      if (running) {
+         nanosleep (&accesslog_interval, NULL);
+      }
+   }
+   free (batch);
+   return NULL;
+}
+
+bool ohs_accesslog_start (int worker_index)
+{
+   if (config_http_access_log == NULL) {
+      return true;
+   }
+
+   accesslog_worker_index = worker_index;
+   accesslog_mask = config_http_access_log_entries - 1;
+   accesslog_ring = malloc (config_http_access_log_entries * sizeof (struct accesslog_entry_struct));
+   if (accesslog_ring == NULL) {
+      abort_message ("Full memory when starting the access log");
+      return false;
+   }
+   for (unsigned long entry_index = 0 ; entry_index <= accesslog_mask ; ++entry_index) {
+      accesslog_ring [entry_index].sequence = entry_index;
+   }
+   if (!accesslog_open ()) {
+      free (accesslog_ring);
+      accesslog_ring = NULL;
+      return false;
+   }
+   accesslog_running = true;
+   if (pthread_create (&accesslog_thread_id, NULL, &accesslog_thread, NULL) != 0) {
+      abort_message ("Can't start access log thread");
+      accesslog_running = false;
+      close (accesslog_fd);
+      accesslog_fd = -1;
+      free (accesslog_ring);
+      accesslog_ring = NULL;
+      return false;
+   }
+   return true;
+}
+
+void ohs_accesslog_stop ()
+{
+   // After the daemons, the last lines are written by the thread
+   if (!accesslog_running) {
+      return;
+   }
+   accesslog_running = false;
+   pthread_join (accesslog_thread_id, NULL);
+   close (accesslog_fd);
+   accesslog_fd = -1;
+   free (accesslog_ring);
+   accesslog_ring = NULL;
+}
+
+void ohs_accesslog_reopen ()
+{
+   // The file is reopened by the thread before its next batch
+   accesslog_reopen_requested = true;
+}
+
+void ohs_accesslog_request (const struct connection_info_struct *connection_info)
+{
+   if (!accesslog_running) {
+      return;
+   }
+
+   unsigned long position = __atomic_load_n (&accesslog_enqueue, __ATOMIC_RELAXED);
+   struct accesslog_entry_struct *entry;
+
+   for (;;) {
+      entry = &accesslog_ring [position & accesslog_mask];
+
+      long sequence_gap = (long) (__atomic_load_n (&entry->sequence, __ATOMIC_ACQUIRE) - position);
+
+      if (sequence_gap == 0) {
+         if (__atomic_compare_exchange_n (&accesslog_enqueue, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+         }
+      }
+      else if (sequence_gap < 0) {
+         // Not yet written by the thread
+         __atomic_add_fetch (&accesslog_dropped, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      else {
+         position = __atomic_load_n (&accesslog_enqueue, __ATOMIC_RELAXED);
+      }
+   }
+
+   struct timespec now;
+   struct tm now_tm;
+   char timestamp [32];
+   char method [64];
+   char uri [512];
+   char subr [128];
+   char bytes [24];
+   size_t line_length;
+
+   clock_gettime (CLOCK_REALTIME, &now);
+   gmtime_r (&now.tv_sec, &now_tm);
+   strftime (timestamp, sizeof (timestamp), "%Y-%m-%dT%H:%M:%S", &now_tm);
+   // Given by the client, escaped as the uri
+   accesslog_escape (method, sizeof (method), connection_info->openqm_req_data.method);
+   accesslog_escape (uri, sizeof (uri), connection_info->openqm_req_data.uri);
+   accesslog_escape (subr, sizeof (subr), connection_info->subr);
+   // null when the length isn't known (stream) or nothing was sent
+   if (connection_info->response_body_length == OHS_BODY_LENGTH_UNKNOWN) {
+      strcpy (bytes, "null");
+   }
+   else {
+      snprintf (bytes, sizeof (bytes), "%zu", connection_info->response_body_length);
+   }
+   line_length = snprintf (entry->line, ACCESSLOG_LINE_SIZE,
+                           "{\"time\":\"%s.%03ldZ\",\"id\":\"%d-%lu\",\"method\":\"%s\",\"uri\":\"%s\",\"status\":%u,\"bytes\":%s,\"subr\":\"%s\",\"total_ms\":%.3f,\"qm_ms\":%.3f}\n",
+                           timestamp,
+                           now.tv_nsec / 1000000,
+                           accesslog_worker_index,
+                           __atomic_add_fetch (&accesslog_request_count, 1, __ATOMIC_RELAXED),
+                           method,
+                           uri,
+                           connection_info->http_status,
+                           bytes,
+                           subr,
+                           (connection_info->phase_time - connection_info->start_time) / 1000.0,
+                           connection_info->phase_durations [rp_calling] / 1000.0);
+   if (line_length >= ACCESSLOG_LINE_SIZE) {
+      // Cut off, the line is closed anyway
+      line_length = ACCESSLOG_LINE_SIZE - 1;
+      entry->line [line_length - 1] = '\n';
+   }
+   entry->line_length = line_length;
+   __atomic_store_n (&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,125 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "openqm_httpd_server.h"
+
+// Administration urls under httpd.admin_path.
+// They are answered by the server itself, without routine, and only to the
+// clients giving the token of httpd.admin_token in "Authorization: Bearer",
+// or to the clients of the unix socket with httpd.socket_admin. Without any
+// of them the administration urls are refused.
+
+// Declarations
+
+static int admin_cache_purge (struct connection_info_struct *connection_info);
+
+// Constants
+
+static const char admin_cache_purge_path [] = "/cache/purge";
+static const char admin_bearer_prefix [] = "Bearer ";
+
+// Functions
+
+bool ohs_admin_client_trusted (struct MHD_Connection *connection, const char *token)
+{
+   // The address of the client isn't checked, behind a reverse proxy on the
+   // local host every request comes from the loopback
+   const union MHD_ConnectionInfo *connection_info = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+   if (config_http_socket_admin && connection_info != NULL && connection_info->client_addr != NULL && connection_info->client_addr->sa_family == AF_UNIX) {
+      return true;
+   }
+   if (token == NULL) {
+      return false;
+   }
+
+   const char *authorization = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_AUTHORIZATION);
+   size_t token_length = strlen (token);
+   unsigned char token_difference = 0;
+
+   if (authorization == NULL || strncasecmp (authorization, admin_bearer_prefix, sizeof (admin_bearer_prefix) - 1) != 0) {
+      return false;
+   }
+   authorization += sizeof (admin_bearer_prefix) - 1;
+   if (strlen (authorization) != token_length) {
+      return false;
+   }
+   // Same time whatever the first different character
+   for (size_t token_index = 0 ; token_index < token_length ; ++token_index) {
+      token_difference |= authorization [token_index] ^ token [token_index];
+   }
+   return token_difference == 0;
+}
+
+int ohs_admin_send_text (struct connection_info_struct *connection_info, unsigned int http_status, const char *text)
+{
+   size_t text_length = strlen (text);
+   struct MHD_Response *response = MHD_create_response_from_buffer (text_length, (void *) text, MHD_RESPMEM_MUST_COPY);
+   int return_status;
+
+   if (response == NULL) {
+      return MHD_NO;
+   }
+   MHD_add_response_header (response, "Content-Type", "text/plain; charset=utf-8");
+   MHD_add_response_header (response, "Cache-Control", "no-store");
+   connection_info->http_status = http_status;
+   connection_info->response_body_length = text_length;
+   return_status = MHD_queue_response (connection_info->connection, http_status, response);
+   MHD_destroy_response (response);
+   return return_status;
+}
+
+int admin_cache_purge (struct connection_info_struct *connection_info)
+{
+   // uri=/exact/uri or prefix=/uri/prefix
+   const char *purge_uri = MHD_lookup_connection_value (connection_info->connection, MHD_GET_ARGUMENT_KIND, "uri");
+   const char *purge_prefix = MHD_lookup_connection_value (connection_info->connection, MHD_GET_ARGUMENT_KIND, "prefix");
+   char purge_pattern [1024];
+   char purge_result [128];
+
+   if ((purge_uri == NULL) == (purge_prefix == NULL)) {
+      return ohs_admin_send_text (connection_info, MHD_HTTP_BAD_REQUEST, "Either uri or prefix must be given\n");
+   }
+   if (purge_uri != NULL) {
+      snprintf (purge_pattern, sizeof (purge_pattern), "%s", purge_uri);
+   }
+   else {
+      snprintf (purge_pattern, sizeof (purge_pattern), "%s*", purge_prefix);
+   }
+   snprintf (purge_result, sizeof (purge_result), "%lu responses purged in this worker, purge sent to all workers\n", ohs_cache_purge (purge_pattern));
+   return ohs_admin_send_text (connection_info, MHD_HTTP_OK, purge_result);
+}
+
+bool ohs_admin_url (const char *url)
+{
+   size_t admin_path_length;
+
+   if (config_http_admin_path == NULL) {
+      return false;
+   }
+   admin_path_length = strlen (config_http_admin_path);
+   return strncmp (url, config_http_admin_path, admin_path_length) == 0 && (url [admin_path_length] == '/' || url [admin_path_length] == '\0');
+}
+
+int ohs_admin_handle (struct connection_info_struct *connection_info, const char *url, const char *method)
+{
+   const char *admin_url = url + strlen (config_http_admin_path);
+
+   if (!ohs_admin_client_trusted (connection_info->connection, config_http_admin_token)) {
+      abort_message ("Administration url refused to an unauthenticated client");
+      return ohs_admin_send_text (connection_info, MHD_HTTP_FORBIDDEN, "Forbidden\n");
+   }
+   if (strcmp (method, "GET") != 0 && strcmp (method, "POST") != 0) {
+      return ohs_admin_send_text (connection_info, MHD_HTTP_METHOD_NOT_ALLOWED, "Method not allowed\n");
+   }
+   if (strcmp (admin_url, admin_cache_purge_path) == 0) {
+      return admin_cache_purge (connection_info);
+   }
+   return ohs_admin_send_text (connection_info, MHD_HTTP_NOT_FOUND, "Unknown administration url\n");
+}
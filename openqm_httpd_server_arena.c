@@ -0,0 +1,180 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openqm_httpd_server.h"
+
+// Per-request arena.
+// All the memory needed by a request is carved in the arena of its connection
+// and released at once by request_completed. The arenas are recycled through a
+// free list, so in steady state a request doesn't call malloc.
+
+// Types
+
+struct arena_block_struct {
+   struct arena_block_struct *next;
+   size_t                     size;
+   size_t                     used;
+   // Aligned as malloc, the header is padded up to it
+   _Alignas (max_align_t) char data [];
+};
+
+struct ohs_arena_struct {
+   struct arena_block_struct *first_block;   // Kept when the arena is recycled
+   struct arena_block_struct *current_block;
+   struct arena_block_struct *large_blocks;  // Allocations bigger than a block
+   struct ohs_arena_struct   *next_free;
+};
+
+// Declarations
+
+static struct arena_block_struct *arena_block_create (size_t size);
+
+// Constants
+
+static const size_t arena_block_size = 16384;
+static const size_t arena_alignment = _Alignof (max_align_t);
+static const int arena_free_max = 256;
+
+// Globals variables
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ohs_arena_struct *arena_first_free = NULL;
+static int arena_free_length = 0;
+
+// Functions
+
+struct arena_block_struct *arena_block_create (size_t size)
+{
+   struct arena_block_struct *arena_block = malloc (sizeof (struct arena_block_struct) + size);
+
+   if (arena_block != NULL) {
+      arena_block->next = NULL;
+      arena_block->size = size;
+      arena_block->used = 0;
+   }
+   return arena_block;
+}
+
+struct ohs_arena_struct *ohs_arena_acquire ()
+{
+   struct ohs_arena_struct *arena;
+
+   pthread_mutex_lock (&arena_mutex);
+   arena = arena_first_free;
+   if (arena != NULL) {
+      arena_first_free = arena->next_free;
+      --arena_free_length;
+   }
+   pthread_mutex_unlock (&arena_mutex);
+   if (arena != NULL) {
+      return arena;
+   }
+
+   arena = malloc (sizeof (struct ohs_arena_struct));
+   if (arena == NULL) {
+      return NULL;
+   }
+   arena->first_block = arena_block_create (arena_block_size);
+   if (arena->first_block == NULL) {
+      free (arena);
+      return NULL;
+   }
+   arena->current_block = arena->first_block;
+   arena->large_blocks = NULL;
+   arena->next_free = NULL;
+   return arena;
+}
+
+void *ohs_arena_alloc (struct ohs_arena_struct *arena, size_t size)
+{
+   size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+
+   // Large allocations have their own block
+   if (size > arena_block_size / 2) {
+      struct arena_block_struct *large_block = arena_block_create (size);
+
+      if (large_block == NULL) {
+         return NULL;
+      }
+      large_block->used = size;
+      large_block->next = arena->large_blocks;
+      arena->large_blocks = large_block;
+      return large_block->data;
+   }
+
+   struct arena_block_struct *arena_block = arena->current_block;
+
+   if (arena_block->used + size > arena_block->size) {
+      arena_block = arena_block_create (arena_block_size);
+      if (arena_block == NULL) {
+         return NULL;
+      }
+      arena->current_block->next = arena_block;
+      arena->current_block = arena_block;
+   }
+
+   void *memory = arena_block->data + arena_block->used;
+
+   arena_block->used += size;
+   return memory;
+}
+
+char *ohs_arena_strndup (struct ohs_arena_struct *arena, const char *string, size_t string_length)
+{
+   char *new_string = ohs_arena_alloc (arena, string_length + 1);
+
+   if (new_string != NULL) {
+      memcpy (new_string, string, string_length);
+      new_string [string_length] = '\0';
+   }
+   return new_string;
+}
+
+char *ohs_arena_strdup (struct ohs_arena_struct *arena, const char *string)
+{
+   return ohs_arena_strndup (arena, string, strlen (string));
+}
+
+void ohs_arena_release (struct ohs_arena_struct *arena)
+{
+   // Only the first block is kept for the next request
+   struct arena_block_struct *arena_block = arena->first_block->next;
+
+   while (arena_block != NULL) {
+      struct arena_block_struct *next_block = arena_block->next;
+
+      free (arena_block);
+      arena_block = next_block;
+   }
+   arena_block = arena->large_blocks;
+   while (arena_block != NULL) {
+      struct arena_block_struct *next_block = arena_block->next;
+
+      free (arena_block);
+      arena_block = next_block;
+   }
+   arena->first_block->next = NULL;
+   arena->first_block->used = 0;
+   arena->current_block = arena->first_block;
+   arena->large_blocks = NULL;
+
+   pthread_mutex_lock (&arena_mutex);
+   if (arena_free_length < arena_free_max) {
+      arena->next_free = arena_first_free;
+      arena_first_free = arena;
+      ++arena_free_length;
+      arena = NULL;
+   }
+   pthread_mutex_unlock (&arena_mutex);
+   if (arena != NULL) {
+      free (arena->first_block);
+      free (arena);
+   }
+}
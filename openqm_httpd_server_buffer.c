@@ -0,0 +1,153 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "openqm_httpd_server.h"
+
+// Pools of the buffers given to the routines for http_output and header_out.
+// The buffers are reused between requests, http_output is given to MHD and
+// comes back to its pool by the free callback of the response.
+
+// Types
+
+struct buffer_free_struct {
+   struct buffer_free_struct *next;
+};
+
+struct buffer_pool_struct {
+   size_t                     buffer_size;
+   pthread_mutex_t            pool_mutex;
+   struct buffer_free_struct *first_free;
+   struct ohs_buffer_stats_struct stats;
+};
+
+// Constants
+
+static const char *buffer_pool_names [] = {
+   [bp_http_output] = "http_output",
+   [bp_header_out]  = "header_out"
+};
+
+// Globals variables
+
+static struct buffer_pool_struct buffer_pools [] = {
+   [bp_http_output] = { .buffer_size = 65536, .pool_mutex = PTHREAD_MUTEX_INITIALIZER },
+   [bp_header_out]  = { .buffer_size = 16384, .pool_mutex = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Functions
+
+size_t ohs_buffer_size (enum buffer_pool_enum pool_id)
+{
+   return buffer_pools [pool_id].buffer_size;
+}
+
+const char *ohs_buffer_pool_name (enum buffer_pool_enum pool_id)
+{
+   return buffer_pool_names [pool_id];
+}
+
+char *ohs_buffer_acquire (enum buffer_pool_enum pool_id)
+{
+   struct buffer_pool_struct *buffer_pool = &buffer_pools [pool_id];
+   struct buffer_free_struct *buffer;
+
+   pthread_mutex_lock (&buffer_pool->pool_mutex);
+   buffer = buffer_pool->first_free;
+   if (buffer != NULL) {
+      buffer_pool->first_free = buffer->next;
+      --buffer_pool->stats.free_length;
+   }
+   ++buffer_pool->stats.in_use;
+   if (buffer_pool->stats.in_use > buffer_pool->stats.high_water) {
+      buffer_pool->stats.high_water = buffer_pool->stats.in_use;
+   }
+   ohs_metrics_buffer (pool_id, &buffer_pool->stats);
+   pthread_mutex_unlock (&buffer_pool->pool_mutex);
+   if (buffer != NULL) {
+      return (char *) buffer;
+   }
+
+   buffer = malloc (buffer_pool->buffer_size);
+   pthread_mutex_lock (&buffer_pool->pool_mutex);
+   if (buffer == NULL) {
+      --buffer_pool->stats.in_use;
+   }
+   else {
+      ++buffer_pool->stats.allocated;
+   }
+   ohs_metrics_buffer (pool_id, &buffer_pool->stats);
+   pthread_mutex_unlock (&buffer_pool->pool_mutex);
+   return (char *) buffer;
+}
+
+void ohs_buffer_release (enum buffer_pool_enum pool_id, char *buffer_memory)
+{
+   struct buffer_pool_struct *buffer_pool = &buffer_pools [pool_id];
+   struct buffer_free_struct *buffer = (struct buffer_free_struct *) buffer_memory;
+
+   pthread_mutex_lock (&buffer_pool->pool_mutex);
+   --buffer_pool->stats.in_use;
+   if (buffer_pool->stats.free_length < config_http_buffer_pool_max) {
+      buffer->next = buffer_pool->first_free;
+      buffer_pool->first_free = buffer;
+      ++buffer_pool->stats.free_length;
+      buffer = NULL;
+   }
+   else {
+      --buffer_pool->stats.allocated;
+   }
+   ohs_metrics_buffer (pool_id, &buffer_pool->stats);
+   pthread_mutex_unlock (&buffer_pool->pool_mutex);
+   if (buffer != NULL) {
+      free (buffer);
+   }
+}
+
+void ohs_http_output_free (void *buffer_memory)
+{
+   // MHD free callback of the responses built from http_output
+   ohs_buffer_release (bp_http_output, buffer_memory);
+}
+
+void ohs_buffer_stats (enum buffer_pool_enum pool_id, struct ohs_buffer_stats_struct *buffer_stats)
+{
+   struct buffer_pool_struct *buffer_pool = &buffer_pools [pool_id];
+
+   pthread_mutex_lock (&buffer_pool->pool_mutex);
+   *buffer_stats = buffer_pool->stats;
+   pthread_mutex_unlock (&buffer_pool->pool_mutex);
+}
+
+void ohs_buffer_log_stats ()
+{
+   for (int pool_id = 0 ; pool_id < bp_count ; ++pool_id) {
+      struct ohs_buffer_stats_struct buffer_stats;
+
+      ohs_buffer_stats (pool_id, &buffer_stats);
+      ohs_log (LOG_INFO, "Buffer pool %s: size=%zu allocated=%lu in_use=%lu high_water=%lu free=%lu", buffer_pool_names [pool_id], buffer_pools [pool_id].buffer_size, buffer_stats.allocated, buffer_stats.in_use, buffer_stats.high_water, buffer_stats.free_length);
+   }
+}
+
+void ohs_buffer_free ()
+{
+   for (int pool_id = 0 ; pool_id < bp_count ; ++pool_id) {
+      struct buffer_pool_struct *buffer_pool = &buffer_pools [pool_id];
+
+      pthread_mutex_lock (&buffer_pool->pool_mutex);
+      while (buffer_pool->first_free != NULL) {
+         struct buffer_free_struct *buffer = buffer_pool->first_free;
+
+         buffer_pool->first_free = buffer->next;
+         free (buffer);
+         --buffer_pool->stats.allocated;
+      }
+      buffer_pool->stats.free_length = 0;
+      ohs_metrics_buffer (pool_id, &buffer_pool->stats);
+      pthread_mutex_unlock (&buffer_pool->pool_mutex);
+   }
+}
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE // strcasestr
+
+#include <errno.h>
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <qmdefs.h>
+
+#include "openqm_httpd_server.h"
+
+// Cache of the responses of the GET routes with a cache_ttl.
+// The key is built by the caller from the url, the query string and the
+// significant headers. Each entry keeps a MHD response which is queued again
+// for each hit, MHD counts the connections still sending it so an entry can be
+// evicted at any time: its memory is freed by the free callback of the body
+// when the last send is done. The least recently used entries are evicted when
+// httpd.cache_max is reached.
+// The purges are published in a log shared by all the workers, each worker
+// applies the purges it hasn't seen yet before using its cache.
+
+// Types
+
+struct cache_entry_struct {
+   struct cache_entry_struct *hash_next;
+   struct cache_entry_struct *lru_previous;
+   struct cache_entry_struct *lru_next;
+   unsigned int               hash;
+   const char                *key;         // After the body
+   size_t                     key_length;
+   size_t                     memory_size;
+   time_t                     expire_time;
+   unsigned int               http_status;
+   size_t                     body_length;
+   struct MHD_Response       *response;
+   char                       body [];
+};
+
+struct cache_purge_struct {
+   unsigned long sequence;
+   char          pattern [256];  // Uri, or uri prefix ending by *
+};
+
+struct cache_purge_log_struct {
+   pthread_mutex_t           purge_mutex;  // Shared between the processes
+   unsigned long             sequence;     // Last purge published
+   struct cache_purge_struct purges [256];
+};
+
+// Declarations
+
+static unsigned int cache_hash (const char *key, size_t key_length);
+static struct cache_entry_struct *cache_find (unsigned int hash, const char *key, size_t key_length);
+static void cache_entry_remove (struct cache_entry_struct *cache_entry);
+static void cache_lru_push (struct cache_entry_struct *cache_entry);
+static void cache_lru_unlink (struct cache_entry_struct *cache_entry);
+static void cache_body_free (void *body);
+static bool cache_entry_match (const struct cache_entry_struct *cache_entry, const char *pattern);
+static unsigned long cache_purge_apply (const char *pattern);
+static void cache_purge_log_lock ();
+static void cache_purge_catch_up ();
+static void cache_purge_sync ();
+
+// Constants
+
+#define CACHE_BUCKET_COUNT 4096
+
+// Globals variables
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry_struct *cache_buckets [CACHE_BUCKET_COUNT];
+static struct cache_entry_struct *cache_lru_first = NULL;  // Most recently used
+static struct cache_entry_struct *cache_lru_last = NULL;
+static size_t cache_memory = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static struct cache_purge_log_struct *cache_purge_log = NULL;
+static unsigned long cache_purge_applied = 0;
+
+// Functions
+
+unsigned int cache_hash (const char *key, size_t key_length)
+{
+   // FNV-1a
+   unsigned int hash = 2166136261u;
+
+   for (size_t key_index = 0 ; key_index < key_length ; ++key_index) {
+      hash ^= (unsigned char) key [key_index];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+struct cache_entry_struct *cache_find (unsigned int hash, const char *key, size_t key_length)
+{
+   struct cache_entry_struct *cache_entry = cache_buckets [hash & (CACHE_BUCKET_COUNT - 1)];
+
+   while (cache_entry != NULL && !(cache_entry->hash == hash && cache_entry->key_length == key_length && memcmp (cache_entry->key, key, key_length) == 0)) {
+      cache_entry = cache_entry->hash_next;
+   }
+   return cache_entry;
+}
+
+void cache_lru_push (struct cache_entry_struct *cache_entry)
+{
+   cache_entry->lru_previous = NULL;
+   cache_entry->lru_next = cache_lru_first;
+   if (cache_lru_first != NULL) {
+      cache_lru_first->lru_previous = cache_entry;
+   }
+   else {
+      cache_lru_last = cache_entry;
+   }
+   cache_lru_first = cache_entry;
+}
+
+void cache_lru_unlink (struct cache_entry_struct *cache_entry)
+{
+   if (cache_entry->lru_previous != NULL) {
+      cache_entry->lru_previous->lru_next = cache_entry->lru_next;
+   }
+   else {
+      cache_lru_first = cache_entry->lru_next;
+   }
+   if (cache_entry->lru_next != NULL) {
+      cache_entry->lru_next->lru_previous = cache_entry->lru_previous;
+   }
+   else {
+      cache_lru_last = cache_entry->lru_previous;
+   }
+}
+
+void cache_entry_remove (struct cache_entry_struct *cache_entry)
+{
+   // Called with the cache locked
+   struct cache_entry_struct **bucket_entry = &cache_buckets [cache_entry->hash & (CACHE_BUCKET_COUNT - 1)];
+
+   while (*bucket_entry != cache_entry) {
+      bucket_entry = &(*bucket_entry)->hash_next;
+   }
+   *bucket_entry = cache_entry->hash_next;
+   cache_lru_unlink (cache_entry);
+   cache_memory -= cache_entry->memory_size;
+   ohs_metrics_cache_memory (cache_memory);
+   // The entry is freed by cache_body_free when no connection sends it anymore
+   MHD_destroy_response (cache_entry->response);
+}
+
+void cache_body_free (void *body)
+{
+   free ((char *) body - offsetof (struct cache_entry_struct, body));
+}
+
+bool cache_entry_match (const struct cache_entry_struct *cache_entry, const char *pattern)
+{
+   // The uri is the second part of the key
+   const char *uri = memchr (cache_entry->key, FIELD_MARK, cache_entry->key_length);
+
+   if (uri == NULL) {
+      return false;
+   }
+   ++uri;
+
+   const char *uri_end = memchr (uri, FIELD_MARK, cache_entry->key_length - (uri - cache_entry->key));
+   size_t uri_length = uri_end == NULL ? cache_entry->key_length - (uri - cache_entry->key) : (size_t) (uri_end - uri);
+   size_t pattern_length = strlen (pattern);
+
+   if (pattern_length && pattern [pattern_length - 1] == '*') {
+      return uri_length >= pattern_length - 1 && memcmp (uri, pattern, pattern_length - 1) == 0;
+   }
+   return uri_length == pattern_length && memcmp (uri, pattern, pattern_length) == 0;
+}
+
+unsigned long cache_purge_apply (const char *pattern)
+{
+   // Called with the cache locked
+   struct cache_entry_struct *cache_entry = cache_lru_first;
+   unsigned long purge_count = 0;
+
+   while (cache_entry != NULL) {
+      struct cache_entry_struct *next_entry = cache_entry->lru_next;
+
+      if (cache_entry_match (cache_entry, pattern)) {
+         cache_entry_remove (cache_entry);
+         ++purge_count;
+      }
+      cache_entry = next_entry;
+   }
+   return purge_count;
+}
+
+void cache_purge_log_lock ()
+{
+   // A worker may have died holding the lock, the log stays usable
+   if (pthread_mutex_lock (&cache_purge_log->purge_mutex) == EOWNERDEAD) {
+      pthread_mutex_consistent (&cache_purge_log->purge_mutex);
+   }
+}
+
+void cache_purge_catch_up ()
+{
+   // Called with the cache and the log locked, apply the purges published
+   // since the last one applied here
+   unsigned long purge_sequence = cache_purge_log->sequence;
+   int purge_log_size = sizeof (cache_purge_log->purges) / sizeof (cache_purge_log->purges [0]);
+
+   if (purge_sequence - cache_purge_applied > purge_log_size) {
+      // Too late, the log has been overwritten
+      cache_purge_apply ("*");
+   }
+   else {
+      while (cache_purge_applied != purge_sequence) {
+         ++cache_purge_applied;
+         cache_purge_apply (cache_purge_log->purges [cache_purge_applied % purge_log_size].pattern);
+      }
+   }
+   cache_purge_applied = purge_sequence;
+}
+
+void cache_purge_sync ()
+{
+   // Called with the cache locked, apply the purges of the other workers
+   if (cache_purge_log == NULL || __atomic_load_n (&cache_purge_log->sequence, __ATOMIC_ACQUIRE) == cache_purge_applied) {
+      return;
+   }
+   cache_purge_log_lock ();
+   cache_purge_catch_up ();
+   pthread_mutex_unlock (&cache_purge_log->purge_mutex);
+}
+
+bool ohs_cache_init ()
+{
+   // Called by the master before the workers are started
+   pthread_mutexattr_t purge_mutex_attr;
+
+   if (!config_http_cache_max) {
+      return true;
+   }
+   cache_purge_log = mmap (NULL, sizeof (struct cache_purge_log_struct), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (cache_purge_log == MAP_FAILED) {
+      cache_purge_log = NULL;
+      abort_message ("Can't create shared cache purge log");
+      return false;
+   }
+   pthread_mutexattr_init (&purge_mutex_attr);
+   pthread_mutexattr_setpshared (&purge_mutex_attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust (&purge_mutex_attr, PTHREAD_MUTEX_ROBUST);
+   pthread_mutex_init (&cache_purge_log->purge_mutex, &purge_mutex_attr);
+   pthread_mutexattr_destroy (&purge_mutex_attr);
+   cache_purge_log->sequence = 0;
+   return true;
+}
+
+unsigned long ohs_cache_purge (const char *pattern)
+{
+   // Purge in this worker and publish for the other ones, a pattern too long
+   // for the log purges the whole cache of the other workers
+   unsigned long purge_count;
+
+   if (!config_http_cache_max) {
+      return 0;
+   }
+   pthread_mutex_lock (&cache_mutex);
+   if (cache_purge_log == NULL) {
+      purge_count = cache_purge_apply (pattern);
+   }
+   else {
+      // The log stays locked from the catch up to the publication, so no
+      // purge of another worker can be skipped by cache_purge_applied
+      cache_purge_log_lock ();
+      cache_purge_catch_up ();
+      purge_count = cache_purge_apply (pattern);
+
+      int purge_log_size = sizeof (cache_purge_log->purges) / sizeof (cache_purge_log->purges [0]);
+      unsigned long purge_sequence = cache_purge_log->sequence + 1;
+      struct cache_purge_struct *cache_purge = &cache_purge_log->purges [purge_sequence % purge_log_size];
+
+      cache_purge->sequence = purge_sequence;
+      if (strlen (pattern) < sizeof (cache_purge->pattern)) {
+         strcpy (cache_purge->pattern, pattern);
+      }
+      else {
+         strcpy (cache_purge->pattern, "*");
+      }
+      __atomic_store_n (&cache_purge_log->sequence, purge_sequence, __ATOMIC_RELEASE);
+      pthread_mutex_unlock (&cache_purge_log->purge_mutex);
+      // Already applied here
+      cache_purge_applied = purge_sequence;
+   }
+   pthread_mutex_unlock (&cache_mutex);
+   return purge_count;
+}
+
+int ohs_cache_serve (struct MHD_Connection *connection, const char *key, size_t key_length, unsigned int *http_status, size_t *body_length)
+{
+   unsigned int hash = cache_hash (key, key_length);
+   int return_status = -1;
+
+   pthread_mutex_lock (&cache_mutex);
+   cache_purge_sync ();
+   struct cache_entry_struct *cache_entry = cache_find (hash, key, key_length);
+
+   if (cache_entry != NULL && cache_entry->expire_time <= time (NULL)) {
+      cache_entry_remove (cache_entry);
+      cache_entry = NULL;
+   }
+   ohs_metrics_cache_lookup (cache_entry != NULL);
+   if (cache_entry == NULL) {
+      ++cache_misses;
+   }
+   else {
+      ++cache_hits;
+      cache_lru_unlink (cache_entry);
+      cache_lru_push (cache_entry);
+      // Queued under the lock, the response can't be destroyed meanwhile
+      *http_status = cache_entry->http_status;
+      *body_length = cache_entry->body_length;
+      return_status = ohs_etag_queue_response (connection, http_status, body_length, cache_entry->response);
+   }
+   pthread_mutex_unlock (&cache_mutex);
+   return return_status;
+}
+
+bool ohs_cache_cacheable (unsigned int http_status, const struct header_out_struct *header_outs, int header_out_length)
+{
+   // Statuses cacheable by default (RFC 7231), without cookie or private content
+   if (http_status != MHD_HTTP_OK && http_status != 203 && http_status != MHD_HTTP_NO_CONTENT && http_status != 300 && http_status != 301 && http_status != MHD_HTTP_NOT_FOUND && http_status != 410) {
+      return false;
+   }
+   for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+      if (strcasecmp (header_outs [header_out_index].field, "Set-Cookie") == 0) {
+         return false;
+      }
+      if (strcasecmp (header_outs [header_out_index].field, "Cache-Control") == 0 && (strcasestr (header_outs [header_out_index].value, "no-store") != NULL || strcasestr (header_outs [header_out_index].value, "private") != NULL)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+void ohs_cache_store (const char *key, size_t key_length, int cache_ttl, unsigned int http_status, const char *body, size_t body_length, const struct header_out_struct *header_outs, int header_out_length)
+{
+   size_t memory_size = sizeof (struct cache_entry_struct) + body_length + key_length;
+
+   for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+      memory_size += strlen (header_outs [header_out_index].field) + strlen (header_outs [header_out_index].value) + 2;
+   }
+   if (memory_size > config_http_cache_max) {
+      return;
+   }
+
+   struct cache_entry_struct *cache_entry = malloc (sizeof (struct cache_entry_struct) + body_length + key_length);
+
+   if (cache_entry == NULL) {
+      abort_message ("Full memory when storing a response in cache");
+      return;
+   }
+   memcpy (cache_entry->body, body, body_length);
+   memcpy (cache_entry->body + body_length, key, key_length);
+   cache_entry->key = cache_entry->body + body_length;
+   cache_entry->key_length = key_length;
+   cache_entry->hash = cache_hash (key, key_length);
+   cache_entry->memory_size = memory_size;
+   cache_entry->expire_time = time (NULL) + cache_ttl;
+   cache_entry->http_status = http_status;
+   cache_entry->body_length = body_length;
+   cache_entry->response = MHD_create_response_from_buffer_with_free_callback (body_length, cache_entry->body, &cache_body_free);
+   if (cache_entry->response == NULL) {
+      free (cache_entry);
+      return;
+   }
+   for (int header_out_index = 0 ; header_out_index < header_out_length ; ++header_out_index) {
+      if (!ohs_header_out_directive (header_outs [header_out_index].field)) {
+         MHD_add_response_header (cache_entry->response, header_outs [header_out_index].field, header_outs [header_out_index].value);
+      }
+   }
+
+   pthread_mutex_lock (&cache_mutex);
+   cache_purge_sync ();
+   struct cache_entry_struct *old_entry = cache_find (cache_entry->hash, key, key_length);
+
+   if (old_entry != NULL) {
+      cache_entry_remove (old_entry);
+   }
+   cache_entry->hash_next = cache_buckets [cache_entry->hash & (CACHE_BUCKET_COUNT - 1)];
+   cache_buckets [cache_entry->hash & (CACHE_BUCKET_COUNT - 1)] = cache_entry;
+   cache_lru_push (cache_entry);
+   cache_memory += memory_size;
+   while (cache_memory > config_http_cache_max) {
+      cache_entry_remove (cache_lru_last);
+   }
+   ohs_metrics_cache_memory (cache_memory);
+   pthread_mutex_unlock (&cache_mutex);
+}
+
+void ohs_cache_free ()
+{
+   pthread_mutex_lock (&cache_mutex);
+   ohs_log (LOG_INFO, "Response cache: hits=%lu misses=%lu memory=%zu", cache_hits, cache_misses, cache_memory);
+   while (cache_lru_last != NULL) {
+      cache_entry_remove (cache_lru_last);
+   }
+   pthread_mutex_unlock (&cache_mutex);
+}
@@ -0,0 +1,205 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef OHS_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "openqm_httpd_server.h"
+
+// Compression of http_output.
+// The encoding is negotiated from Accept-Encoding when the request is
+// received, so it can be part of the cache key: each encoding has its own
+// response in cache. The body is only compressed when it's larger than
+// httpd.compress_min and its content type isn't already compressed.
+// Brotli is only available when built with OHS_BROTLI.
+
+// Declarations
+
+static double accept_encoding_quality (const char *accept_encoding, const char *coding);
+static char *compress_zlib (const char *body, size_t body_length, int window_bits, size_t *compressed_length);
+#ifdef OHS_BROTLI
+static char *compress_brotli (const char *body, size_t body_length, size_t *compressed_length);
+#endif
+
+// Constants
+
+static const char *content_encoding_names [] = {
+   "identity",
+   "deflate",
+   "gzip",
+   "br"
+};
+
+// Already compressed or binary, except image/svg+xml
+static const char *compress_excluded_types [] = {
+   "image/",
+   "audio/",
+   "video/",
+   "application/zip",
+   "application/gzip",
+   "application/octet-stream"
+};
+
+// Functions
+
+double accept_encoding_quality (const char *accept_encoding, const char *coding)
+{
+   // Quality of coding (or *) in Accept-Encoding, 0 when not accepted
+   size_t coding_length = strlen (coding);
+   double quality = 0;
+   bool coding_found = false;
+
+   while (*accept_encoding != '\0') {
+      while (*accept_encoding == ' ' || *accept_encoding == '\t' || *accept_encoding == ',') {
+         ++accept_encoding;
+      }
+
+      size_t token_length = strcspn (accept_encoding, ",; \t");
+      bool token_match = token_length == coding_length && strncasecmp (accept_encoding, coding, coding_length) == 0;
+      bool token_star = token_length == 1 && *accept_encoding == '*';
+      const char *parameters = accept_encoding + token_length;
+      double token_quality = 1;
+
+      accept_encoding = parameters + strcspn (parameters, ",");
+      if ((token_match || (token_star && !coding_found)) && token_length != 0) {
+         const char *q_parameter = strstr (parameters, "q=");
+
+         if (q_parameter != NULL && q_parameter < accept_encoding) {
+            token_quality = strtod (q_parameter + 2, NULL);
+         }
+         quality = token_quality;
+         coding_found |= token_match;
+      }
+   }
+   return quality;
+}
+
+char *compress_zlib (const char *body, size_t body_length, int window_bits, size_t *compressed_length)
+{
+   z_stream compress_stream;
+   char *compressed = NULL;
+
+   memset (&compress_stream, 0, sizeof (compress_stream));
+   if (deflateInit2 (&compress_stream, config_http_compress_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return NULL;
+   }
+
+   size_t compressed_size = deflateBound (&compress_stream, body_length);
+
+   compressed = malloc (compressed_size);
+   if (compressed != NULL) {
+      compress_stream.next_in = (Bytef *) body;
+      compress_stream.avail_in = body_length;
+      compress_stream.next_out = (Bytef *) compressed;
+      compress_stream.avail_out = compressed_size;
+      if (deflate (&compress_stream, Z_FINISH) == Z_STREAM_END) {
+         *compressed_length = compress_stream.total_out;
+      }
+      else {
+         free (compressed);
+         compressed = NULL;
+      }
+   }
+   deflateEnd (&compress_stream);
+   return compressed;
+}
+
+#ifdef OHS_BROTLI
+char *compress_brotli (const char *body, size_t body_length, size_t *compressed_length)
+{
+   size_t compressed_size = BrotliEncoderMaxCompressedSize (body_length);
+   char *compressed = compressed_size == 0 ? NULL : malloc (compressed_size);
+
+   if (compressed == NULL) {
+      return NULL;
+   }
+   *compressed_length = compressed_size;
+   if (!BrotliEncoderCompress (config_http_compress_level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, body_length, (const uint8_t *) body, compressed_length, (uint8_t *) compressed)) {
+      free (compressed);
+      return NULL;
+   }
+   return compressed;
+}
+#endif
+
+enum content_encoding_enum ohs_compress_negotiate (struct MHD_Connection *connection)
+{
+   // Best encoding accepted by the client, brotli first
+   const char *accept_encoding = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+   enum content_encoding_enum content_encoding = ce_identity;
+   double best_quality = 0;
+
+   if (accept_encoding == NULL) {
+      return ce_identity;
+   }
+   for (enum content_encoding_enum encoding_index = ce_brotli ; encoding_index > ce_identity ; --encoding_index) {
+#ifndef OHS_BROTLI
+      if (encoding_index == ce_brotli) {
+         continue;
+      }
+#endif
+
+      double quality = accept_encoding_quality (accept_encoding, content_encoding_names [encoding_index]);
+
+      if (quality > best_quality) {
+         best_quality = quality;
+         content_encoding = encoding_index;
+      }
+   }
+   return content_encoding;
+}
+
+const char *ohs_compress_encoding_name (enum content_encoding_enum content_encoding)
+{
+   return content_encoding_names [content_encoding];
+}
+
+bool ohs_compress_content_type (const char *content_type)
+{
+   if (content_type == NULL) {
+      return true;
+   }
+   if (strncasecmp (content_type, "image/svg", 9) == 0) {
+      return true;
+   }
+   for (int type_index = 0 ; type_index < sizeof (compress_excluded_types) / sizeof (compress_excluded_types [0]) ; ++type_index) {
+      if (strncasecmp (content_type, compress_excluded_types [type_index], strlen (compress_excluded_types [type_index])) == 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+char *ohs_compress (enum content_encoding_enum content_encoding, const char *body, size_t body_length, size_t *compressed_length)
+{
+   // Returns a buffer to free, NULL when the compression fails or doesn't
+   // reduce the size
+   char *compressed = NULL;
+
+   switch (content_encoding) {
+      case ce_deflate:
+         compressed = compress_zlib (body, body_length, MAX_WBITS, compressed_length);
+         break;
+      case ce_gzip:
+         compressed = compress_zlib (body, body_length, MAX_WBITS + 16, compressed_length);
+         break;
+#ifdef OHS_BROTLI
+      case ce_brotli:
+         compressed = compress_brotli (body, body_length, compressed_length);
+         break;
+#endif
+      default:
+         break;
+   }
+   if (compressed != NULL && *compressed_length >= body_length) {
+      free (compressed);
+      compressed = NULL;
+   }
+   return compressed;
+}
@@ -1,9 +1,13 @@
 #include <libconfig.h>
+#include <limits.h>
 #include <pcre.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
+#include <unistd.h>
 
 #include "openqm_httpd_server.h"
 
@@ -12,20 +16,93 @@
 static void print_memory_full ();
 static void free_url_config (struct url_config_struct *url_config);
 static char *check_openqm_object_name (const char* object_name);
+static bool read_url_string_array (config_setting_t *config_url_elem, const char *name, int *array_length, const char ***array);
 static struct url_config_struct * read_url_config (config_setting_t *config_url_elem);
+static bool read_httpd_int (const char *config_path, int *config_value, int min_value);
 
 // Constants
 
 static const char config_file_name [] = "/etc/openqm_httpd_server.cfg";
 static const char config_path_openqm_account [] = "openqm.account";
 static const char config_path_httpd_port [] = "httpd.port";
+static const char config_path_httpd_workers [] = "httpd.workers";
+static const char config_path_httpd_buffer_pool_max [] = "httpd.buffer_pool_max";
+static const char config_path_httpd_sendfile_dir [] = "httpd.sendfile_dir";
+static const char config_path_httpd_cache_max [] = "httpd.cache_max";
+static const char config_path_httpd_admin_path [] = "httpd.admin_path";
+static const char config_path_httpd_admin_token [] = "httpd.admin_token";
+static const char config_path_httpd_metrics_path [] = "httpd.metrics_path";
+static const char config_path_httpd_metrics_token [] = "httpd.metrics_token";
+static const char config_path_httpd_socket [] = "httpd.socket";
+static const char config_path_httpd_socket_mode [] = "httpd.socket_mode";
+static const char config_path_httpd_socket_admin [] = "httpd.socket_admin";
+static const char config_path_httpd_thread_pool_size [] = "httpd.thread_pool_size";
+static const char config_path_httpd_use_epoll [] = "httpd.use_epoll";
+static const char config_path_httpd_use_poll [] = "httpd.use_poll";
+static const char config_path_httpd_connection_limit [] = "httpd.connection_limit";
+static const char config_path_httpd_per_ip_connection_limit [] = "httpd.per_ip_connection_limit";
+static const char config_path_httpd_connection_timeout [] = "httpd.connection_timeout";
+static const char config_path_httpd_connection_memory_limit [] = "httpd.connection_memory_limit";
+static const char config_path_httpd_listen_backlog [] = "httpd.listen_backlog";
+static const char config_path_httpd_tcp_nodelay [] = "httpd.tcp_nodelay";
+static const char config_path_httpd_tcp_fastopen [] = "httpd.tcp_fastopen";
+static const char config_path_httpd_server_timing [] = "httpd.server_timing";
+static const char config_path_httpd_slow_request [] = "httpd.slow_request_ms";
+static const char config_path_httpd_access_log [] = "httpd.access_log";
+static const char config_path_httpd_access_log_entries [] = "httpd.access_log_entries";
+static const char config_path_httpd_log_level [] = "httpd.log_level";
+static const char config_path_httpd_log_rate_limit [] = "httpd.log_rate_limit";
+static const char config_path_httpd_error_html [] = "httpd.error_html";
+static const char config_path_httpd_error_json [] = "httpd.error_json";
+static const char config_path_httpd_error_xml [] = "httpd.error_xml";
+static const char config_path_httpd_compress_min [] = "httpd.compress_min";
+static const char config_path_httpd_compress_level [] = "httpd.compress_level";
+static const char config_path_httpd_max_body [] = "httpd.max_body";
+static const char config_path_httpd_upload_dir [] = "httpd.upload_dir";
+static const char config_path_openqm_continue_subr [] = "openqm.continue_subr";
 static const char pattern_object_name [] = "^[[:alpha:]][[:alnum:]._-]*$";
+static const char pattern_anchor_begin [] = "(?:";
+static const char pattern_anchor_end [] = ")\\z";
 
 // Globals variables
 
 config_t config_openqm_httpd_server;
 const char *config_openqm_account;
+const char *config_openqm_continue_subr = NULL;
 int config_http_port;
+int config_http_workers;
+int config_http_buffer_pool_max = 64;
+char *config_http_sendfile_dir = NULL;
+char *config_http_upload_dir = NULL;
+int config_http_max_body = 1048576;
+size_t config_http_cache_max = 16777216;
+const char *config_http_admin_path = NULL;
+const char *config_http_admin_token = NULL;
+const char *config_http_metrics_path = NULL;
+const char *config_http_metrics_token = NULL;
+const char *config_http_socket = NULL;
+mode_t config_http_socket_mode = 0660;
+int config_http_socket_admin = 0;
+int config_http_thread_pool_size = 0;
+int config_http_use_epoll = 0;
+int config_http_use_poll = 0;
+int config_http_connection_limit = 0;
+int config_http_per_ip_connection_limit = 0;
+int config_http_connection_timeout = 0;
+int config_http_connection_memory_limit = 0;
+int config_http_listen_backlog = 128;
+int config_http_tcp_nodelay = 0;
+int config_http_tcp_fastopen = 0;
+int config_http_server_timing = 0;
+int config_http_slow_request = 0;
+const char *config_http_access_log = NULL;
+int config_http_access_log_entries = 4096;
+int config_http_log_rate_limit = 10;
+const char *config_http_error_html = NULL;
+const char *config_http_error_json = NULL;
+const char *config_http_error_xml = NULL;
+int config_http_compress_min = 1024;
+int config_http_compress_level = 6;
 struct url_config_struct *first_url_config = NULL;
 
 // Functions
@@ -37,6 +114,9 @@ void print_memory_full ()
 
 void free_url_config (struct url_config_struct *url_config)
 {
+   if (url_config->pattern_extra != NULL) {
+      pcre_free_study (url_config->pattern_extra);
+   }
    if (url_config->pattern_comp != NULL) {
       pcre_free (url_config->pattern_comp);
    }
@@ -46,6 +126,12 @@ void free_url_config (struct url_config_struct *url_config)
    if (url_config->get_param != NULL) {
       free (url_config->get_param);
    }
+   if (url_config->cache_param != NULL) {
+      free (url_config->cache_param);
+   }
+   if (url_config->cache_header != NULL) {
+      free (url_config->cache_header);
+   }
    struct url_config_struct *sub_path_config = url_config->sub_path;
    while (sub_path_config != NULL) {
       struct url_config_struct *next_config = sub_path_config->next;
@@ -92,6 +178,47 @@ char *check_openqm_object_name (const char* object_name)
    return 0;
 }
 
+bool read_url_string_array (config_setting_t *config_url_elem, const char *name, int *array_length, const char ***array)
+{
+   // Optional array of strings, the length stays -1 when it's not configured
+   config_setting_t *config_array = config_setting_get_member (config_url_elem, name);
+
+   if (config_array == NULL) {
+      return true;
+   }
+   if (config_setting_is_array (config_array) == CONFIG_FALSE) {
+      fprintf (stderr, "%s isn't a array\n", name);
+      return false;
+   }
+   *array_length = (int) config_setting_length (config_array);
+   if (*array_length) {
+      *array = malloc (sizeof (const char *) * *array_length);
+      if (*array == NULL) {
+         print_memory_full ();
+         return false;
+      }
+      for (int array_index = 0 ; array_index < *array_length ; ++array_index) {
+         (*array) [array_index] = config_setting_get_string_elem (config_array, array_index);
+         if ((*array) [array_index] == NULL) {
+            fprintf (stderr, "error reading %s %d\n", name, array_index);
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+bool read_httpd_int (const char *config_path, int *config_value, int min_value)
+{
+   // Optional integer, the default value is kept when it's absent
+   config_lookup_int (&config_openqm_httpd_server, config_path, config_value);
+   if (*config_value < min_value) {
+      fprintf (stderr, "Invalid value %d for %s\n", *config_value, config_path);
+      return false;
+   }
+   return true;
+}
+
 struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
 {
    struct url_config_struct *new_url_config;
@@ -103,7 +230,17 @@ struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
    }
    new_url_config->path = NULL;
    new_url_config->pattern_comp = NULL;
+   new_url_config->pattern_extra = NULL;
    new_url_config->subr = NULL;
+   new_url_config->max_body = -1;
+   new_url_config->cache_ttl = 0;
+   new_url_config->coalesce = 0;
+   new_url_config->etag = 0;
+   new_url_config->compress = -1;
+   new_url_config->cache_param_length = -1;
+   new_url_config->cache_param = NULL;
+   new_url_config->cache_header_length = 0;
+   new_url_config->cache_header = NULL;
    new_url_config->method_length = -1;
    new_url_config->method = NULL;
    new_url_config->get_param_length = -1;
@@ -119,25 +256,63 @@ struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
    config_setting_lookup_string (config_url_elem, "path", &new_url_config->path);
    config_setting_lookup_string (config_url_elem, "pattern", &pattern_string);
    config_setting_lookup_string (config_url_elem, "subr", &new_url_config->subr);
-
+   config_setting_lookup_int (config_url_elem, "max_body", &new_url_config->max_body);
+   if (config_setting_get_member (config_url_elem, "max_body") != NULL && new_url_config->max_body < 0) {
+      fprintf (stderr, "Invalid max_body %d\n", new_url_config->max_body);
+      error_config = true;
+   }
+   config_setting_lookup_int (config_url_elem, "cache_ttl", &new_url_config->cache_ttl);
+   if (new_url_config->cache_ttl < 0) {
+      fprintf (stderr, "Invalid cache_ttl %d\n", new_url_config->cache_ttl);
+      error_config = true;
+   }
+   if (!read_url_string_array (config_url_elem, "cache_param", &new_url_config->cache_param_length, &new_url_config->cache_param)) {
+      error_config = true;
+   }
+   if (!read_url_string_array (config_url_elem, "cache_header", &new_url_config->cache_header_length, &new_url_config->cache_header)) {
+      error_config = true;
+   }
+   if (new_url_config->cache_header_length < 0) {
+      new_url_config->cache_header_length = 0;
+   }
+   config_setting_lookup_bool (config_url_elem, "coalesce", &new_url_config->coalesce);
+   config_setting_lookup_bool (config_url_elem, "etag", &new_url_config->etag);
+   config_setting_lookup_bool (config_url_elem, "compress", &new_url_config->compress);
 
    if ((new_url_config->path == NULL) == (pattern_string == NULL)) {
       fprintf (stderr, "Either path (%s) or pattern (%s) must be present\n", new_url_config->path, pattern_string);
       error_config = true;
    }
-#ifdef OHS_DEBUG
-   printf ("Find path=%s, pattern=%s\n", new_url_config->path, pattern_string);
-#endif
+   ohs_log_debug ("Find path=%s, pattern=%s", new_url_config->path, pattern_string);
 
    if (pattern_string != NULL) {
       const char *error;
       int erroffset;
+      // The pattern must match the whole folder name
+      size_t anchored_length = strlen (pattern_string) + sizeof (pattern_anchor_begin) + sizeof (pattern_anchor_end);
+      char *anchored_pattern = malloc (anchored_length);
 
-      new_url_config->pattern_comp = pcre_compile (pattern_string, 0, &error, &erroffset, NULL);
-      if (new_url_config->pattern_comp == NULL) {
-         fprintf (stderr, "PCRE compilation failed for pattern \"%s\" at offset %d: %s\n", pattern_string, erroffset, error);
+      if (anchored_pattern == NULL) {
+         print_memory_full ();
          error_config = true;
       }
+      else {
+         snprintf (anchored_pattern, anchored_length, "%s%s%s", pattern_anchor_begin, pattern_string, pattern_anchor_end);
+         new_url_config->pattern_comp = pcre_compile (anchored_pattern, PCRE_ANCHORED, &error, &erroffset, NULL);
+         free (anchored_pattern);
+         if (new_url_config->pattern_comp == NULL) {
+            fprintf (stderr, "PCRE compilation failed for pattern \"%s\" at offset %d: %s\n", pattern_string, erroffset - (int) strlen (pattern_anchor_begin), error);
+            error_config = true;
+         }
+         else {
+            // JIT compile, pcre_exec falls back on the interpreter when JIT isn't available
+            new_url_config->pattern_extra = pcre_study (new_url_config->pattern_comp, PCRE_STUDY_JIT_COMPILE, &error);
+            if (error != NULL) {
+               fprintf (stderr, "PCRE study failed for pattern \"%s\": %s\n", pattern_string, error);
+               error_config = true;
+            }
+         }
+      }
    }
 
    // Check subr name
@@ -172,8 +347,8 @@ struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
                      fprintf (stderr, "error reading method %d\n", method_index);
                      error_config = true;
                   }
-                  else if (strcasecmp (method_elem, "GET") != 0 && strcasecmp (method_elem, "POST") != 0 && strcasecmp (method_elem, "PUT") != 0 && strcasecmp (method_elem, "PATCH") != 0 && strcasecmp (method_elem, "DELETE")) {
-                     fprintf (stderr, "unknown method %d\n", method_index);
+                  else if (ohs_method_bit (method_elem) == 0) {
+                     fprintf (stderr, "unknown method %s\n", method_elem);
                      error_config = true;
                      method_elem = NULL;
                   }
@@ -222,9 +397,7 @@ struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
       }
       else {
          unsigned int sub_path_length = config_setting_length (config_url_sub_path);
-#ifdef OHS_DEBUG
-         printf ("Find %u sub_path\n", sub_path_length);
-#endif
+         ohs_log_debug ("Find %u sub_path", sub_path_length);
          if (sub_path_length) {
             struct url_config_struct *prev_sub_path_config = NULL;
             for (unsigned int sub_path_index = 0 ; sub_path_index < sub_path_length ; ++sub_path_index) {
@@ -256,9 +429,7 @@ struct url_config_struct * read_url_config (config_setting_t *config_url_elem)
                   prev_sub_path_config = sub_path_config;
                }
             }
-#ifdef OHS_DEBUG
-            printf ("Config->sub_path=%p\n", new_url_config->sub_path);
-#endif
+            ohs_log_debug ("Config->sub_path=%p", new_url_config->sub_path);
          }
       }
    }
@@ -282,6 +453,179 @@ bool ohs_config_read ()
       fprintf (stderr, "Can't find configuration %s in file %s:%d %s\n", config_path_httpd_port, config_error_file (&config_openqm_httpd_server), config_error_line (&config_openqm_httpd_server), config_error_text (&config_openqm_httpd_server));
       return false;
    }
+   // httpd.workers (optional, one worker per core by default)
+   if (config_lookup_int (&config_openqm_httpd_server, config_path_httpd_workers, &config_http_workers) != CONFIG_TRUE) {
+      config_http_workers = (int) sysconf (_SC_NPROCESSORS_ONLN);
+      if (config_http_workers < 1) {
+         config_http_workers = 1;
+      }
+   }
+   else if (config_http_workers < 1) {
+      fprintf (stderr, "Invalid number of workers %d\n", config_http_workers);
+      return false;
+   }
+   // httpd.buffer_pool_max (optional)
+   config_lookup_int (&config_openqm_httpd_server, config_path_httpd_buffer_pool_max, &config_http_buffer_pool_max);
+   if (config_http_buffer_pool_max < 0) {
+      fprintf (stderr, "Invalid buffer pool size %d\n", config_http_buffer_pool_max);
+      return false;
+   }
+   // httpd.sendfile_dir (optional), kept as real path to check the files
+   const char *sendfile_dir = NULL;
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_sendfile_dir, &sendfile_dir);
+   if (sendfile_dir != NULL) {
+      config_http_sendfile_dir = realpath (sendfile_dir, NULL);
+      if (config_http_sendfile_dir == NULL) {
+         fprintf (stderr, "Invalid sendfile directory %s: %m\n", sendfile_dir);
+         return false;
+      }
+   }
+   // httpd.max_body (optional)
+   config_lookup_int (&config_openqm_httpd_server, config_path_httpd_max_body, &config_http_max_body);
+   if (config_http_max_body < 0) {
+      fprintf (stderr, "Invalid maximum body size %d\n", config_http_max_body);
+      return false;
+   }
+   // httpd.cache_max (optional), 0 disables the cache
+   int cache_max = (int) config_http_cache_max;
+   config_lookup_int (&config_openqm_httpd_server, config_path_httpd_cache_max, &cache_max);
+   if (cache_max < 0) {
+      fprintf (stderr, "Invalid cache size %d\n", cache_max);
+      return false;
+   }
+   config_http_cache_max = cache_max;
+   // httpd.admin_path (optional)
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_admin_path, &config_http_admin_path);
+   if (config_http_admin_path != NULL && (config_http_admin_path [0] != '/' || config_http_admin_path [1] == '\0')) {
+      fprintf (stderr, "Invalid administration path %s\n", config_http_admin_path);
+      return false;
+   }
+   // httpd.socket, httpd.socket_mode and httpd.socket_admin (optional), octal
+   // mode in a string
+   const char *socket_mode = NULL;
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_socket, &config_http_socket);
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_socket_mode, &socket_mode);
+   config_lookup_bool (&config_openqm_httpd_server, config_path_httpd_socket_admin, &config_http_socket_admin);
+   if (config_http_socket != NULL && config_http_socket [0] != '/') {
+      fprintf (stderr, "Socket path %s must be absolute\n", config_http_socket);
+      return false;
+   }
+   if (socket_mode != NULL) {
+      char *socket_mode_end;
+      long socket_mode_value = strtol (socket_mode, &socket_mode_end, 8);
+
+      if (*socket_mode == '\0' || *socket_mode_end != '\0' || socket_mode_value < 0 || socket_mode_value > 0777) {
+         fprintf (stderr, "Invalid socket mode %s\n", socket_mode);
+         return false;
+      }
+      config_http_socket_mode = socket_mode_value;
+   }
+   // httpd.admin_token (optional), without it and socket_admin the
+   // administration urls are refused
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_admin_token, &config_http_admin_token);
+   if (config_http_admin_token != NULL && strlen (config_http_admin_token) < 16) {
+      fprintf (stderr, "Administration token too short, minimum 16 characters\n");
+      return false;
+   }
+   if (config_http_admin_path != NULL && config_http_admin_token == NULL && !config_http_socket_admin) {
+      fprintf (stderr, "Warning: %s without %s or %s, the administration urls are refused\n", config_path_httpd_admin_path, config_path_httpd_admin_token, config_path_httpd_socket_admin);
+   }
+   // MHD tuning (optional), 0 keeps the default of libmicrohttpd
+   if (!read_httpd_int (config_path_httpd_thread_pool_size, &config_http_thread_pool_size, 0)
+       || !read_httpd_int (config_path_httpd_connection_limit, &config_http_connection_limit, 0)
+       || !read_httpd_int (config_path_httpd_per_ip_connection_limit, &config_http_per_ip_connection_limit, 0)
+       || !read_httpd_int (config_path_httpd_connection_timeout, &config_http_connection_timeout, 0)
+       || !read_httpd_int (config_path_httpd_connection_memory_limit, &config_http_connection_memory_limit, 0)
+       || !read_httpd_int (config_path_httpd_listen_backlog, &config_http_listen_backlog, 1)
+       || !read_httpd_int (config_path_httpd_tcp_fastopen, &config_http_tcp_fastopen, 0)) {
+      return false;
+   }
+   if (config_http_connection_memory_limit != 0 && config_http_connection_memory_limit < 4096) {
+      fprintf (stderr, "Invalid connection memory limit %d, minimum 4096\n", config_http_connection_memory_limit);
+      return false;
+   }
+   config_lookup_bool (&config_openqm_httpd_server, config_path_httpd_use_epoll, &config_http_use_epoll);
+   config_lookup_bool (&config_openqm_httpd_server, config_path_httpd_use_poll, &config_http_use_poll);
+   config_lookup_bool (&config_openqm_httpd_server, config_path_httpd_tcp_nodelay, &config_http_tcp_nodelay);
+   if (config_http_use_epoll && config_http_use_poll) {
+      fprintf (stderr, "use_epoll and use_poll can't be used together\n");
+      return false;
+   }
+   // httpd.compress_min (optional), 0 disables the compression
+   config_lookup_int (&config_openqm_httpd_server, config_path_httpd_compress_min, &config_http_compress_min);
+   if (config_http_compress_min < 0) {
+      fprintf (stderr, "Invalid minimum size to compress %d\n", config_http_compress_min);
+      return false;
+   }
+   // httpd.compress_level (optional)
+   config_lookup_int (&config_openqm_httpd_server, config_path_httpd_compress_level, &config_http_compress_level);
+   if (config_http_compress_level < 1 || config_http_compress_level > 9) {
+      fprintf (stderr, "Invalid compression level %d\n", config_http_compress_level);
+      return false;
+   }
+   // httpd.metrics_path (optional)
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_metrics_path, &config_http_metrics_path);
+   if (config_http_metrics_path != NULL && config_http_metrics_path [0] != '/') {
+      fprintf (stderr, "Invalid metrics path %s\n", config_http_metrics_path);
+      return false;
+   }
+   // httpd.metrics_token (optional), admin_token when it isn't given so the
+   // scrapers can get the metrics without the administration token
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_metrics_token, &config_http_metrics_token);
+   if (config_http_metrics_token == NULL) {
+      config_http_metrics_token = config_http_admin_token;
+   }
+   else if (strlen (config_http_metrics_token) < 16) {
+      fprintf (stderr, "Metrics token too short, minimum 16 characters\n");
+      return false;
+   }
+   if (config_http_metrics_path != NULL && config_http_metrics_token == NULL && !config_http_socket_admin) {
+      fprintf (stderr, "Warning: %s without %s or %s, the metrics are refused\n", config_path_httpd_metrics_path, config_path_httpd_metrics_token, config_path_httpd_socket_admin);
+   }
+   // httpd.log_level and httpd.log_rate_limit (optional), 0 doesn't limit
+   const char *log_level = NULL;
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_log_level, &log_level);
+   if (log_level != NULL) {
+      int log_level_value = ohs_log_level_value (log_level);
+
+      if (log_level_value < LOG_ERR) {
+         fprintf (stderr, "Invalid log level %s\n", log_level);
+         return false;
+      }
+      ohs_log_init (log_level_value);
+   }
+   if (!read_httpd_int (config_path_httpd_log_rate_limit, &config_http_log_rate_limit, 0)) {
+      return false;
+   }
+   // httpd.error_html, httpd.error_json and httpd.error_xml (optional)
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_error_html, &config_http_error_html);
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_error_json, &config_http_error_json);
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_error_xml, &config_http_error_xml);
+   // httpd.server_timing and httpd.slow_request_ms (optional), 0 disables the log
+   config_lookup_bool (&config_openqm_httpd_server, config_path_httpd_server_timing, &config_http_server_timing);
+   if (!read_httpd_int (config_path_httpd_slow_request, &config_http_slow_request, 0)) {
+      return false;
+   }
+   // httpd.access_log (optional), the ring size is rounded up to a power of 2
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_access_log, &config_http_access_log);
+   if (!read_httpd_int (config_path_httpd_access_log_entries, &config_http_access_log_entries, 2)
+       || config_http_access_log_entries > 1048576) {
+      fprintf (stderr, "Invalid access log entries %d\n", config_http_access_log_entries);
+      return false;
+   }
+   while ((config_http_access_log_entries & (config_http_access_log_entries - 1)) != 0) {
+      config_http_access_log_entries += config_http_access_log_entries & -config_http_access_log_entries;
+   }
+   // httpd.upload_dir (optional)
+   const char *upload_dir = NULL;
+   config_lookup_string (&config_openqm_httpd_server, config_path_httpd_upload_dir, &upload_dir);
+   if (upload_dir != NULL) {
+      config_http_upload_dir = realpath (upload_dir, NULL);
+      if (config_http_upload_dir == NULL || access (config_http_upload_dir, W_OK) != 0) {
+         fprintf (stderr, "Invalid upload directory %s: %m\n", upload_dir);
+         return false;
+      }
+   }
    // httpd.env
    config_setting_t *config_httpd_env = config_lookup (&config_openqm_httpd_server, "httpd.env");
    if (config_httpd_env != NULL) {
@@ -291,9 +635,7 @@ bool ohs_config_read ()
          fprintf (stderr, "Incorrect url configuration type\n");
          return false;
       }
-#ifdef OHS_DEBUG
-      printf ("Config httpd.env=%u\n", env_count);
-#endif
+      ohs_log_debug ("Config httpd.env=%u", env_count);
       for (unsigned int env_index = 0 ; env_index < env_count ; ++env_index) {
          config_setting_t *config_httpd_env_index = config_setting_get_elem (config_httpd_env, env_index);
          if (config_httpd_env_index != NULL) {
@@ -301,9 +643,7 @@ bool ohs_config_read ()
             const char *value = config_setting_get_string (config_httpd_env_index);
             if (name != NULL && value != NULL) {
                setenv (name, value, true);
-#ifdef OHS_DEBUG
-               printf ("Setenv %s=%s\n", name, value);
-#endif
+               ohs_log_debug ("Setenv %s=%s", name, value);
             }
          }
       }
@@ -317,6 +657,16 @@ bool ohs_config_read ()
       fprintf (stderr, "OpenQM account not configured\n");
       return false;
    }
+   // openqm.continue_subr (optional)
+   config_lookup_string (&config_openqm_httpd_server, config_path_openqm_continue_subr, &config_openqm_continue_subr);
+   if (config_openqm_continue_subr != NULL) {
+      char *subr_name_error_message = check_openqm_object_name (config_openqm_continue_subr);
+      if (subr_name_error_message != NULL) {
+         fprintf (stderr, "Continue subroutine name (%s) error: %s\n", config_openqm_continue_subr, subr_name_error_message);
+         free (subr_name_error_message);
+         return false;
+      }
+   }
 
    // url
    config_setting_t *config_url = config_lookup (&config_openqm_httpd_server, "url");
@@ -330,6 +680,7 @@ bool ohs_config_read ()
    }
 
    unsigned int url_length = config_setting_length (config_url);
+   struct url_config_struct *last_url_config = NULL;
    for (unsigned int url_index = 0 ; url_index < url_length ; ++url_index) {
       config_setting_t *config_url_elem = config_setting_get_elem (config_url, url_index);
       if (config_url_elem != NULL) {
@@ -338,19 +689,34 @@ bool ohs_config_read ()
             fprintf (stderr, "Previous error in url %d\n", url_index);
             return false;
          }
-         new_url_config->next = first_url_config;
-         first_url_config = new_url_config;
+         // Keep the configuration order, patterns are tried in this order
+         if (last_url_config == NULL) {
+            first_url_config = new_url_config;
+         }
+         else {
+            last_url_config->next = new_url_config;
+         }
+         last_url_config = new_url_config;
       }
    }
-#ifdef OHS_DEBUG
-   printf ("First config path=%s sub_path=%p\n", first_url_config->path, first_url_config->sub_path);
-#endif
+   if (first_url_config != NULL) {
+      ohs_log_debug ("First config path=%s sub_path=%p", first_url_config->path, first_url_config->sub_path);
+   }
 
-   return true;
+   return ohs_route_compile ();
 }
 
 void ohs_config_free ()
 {
+   ohs_route_free ();
+   if (config_http_sendfile_dir != NULL) {
+      free (config_http_sendfile_dir);
+      config_http_sendfile_dir = NULL;
+   }
+   if (config_http_upload_dir != NULL) {
+      free (config_http_upload_dir);
+      config_http_upload_dir = NULL;
+   }
    while (first_url_config != NULL) {
       struct url_config_struct *current_url_config = first_url_config;
 
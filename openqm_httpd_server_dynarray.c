@@ -0,0 +1,201 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qmdefs.h>
+
+#include "openqm_httpd_server.h"
+
+// Builder of the key/value dynamic arrays passed to the routines.
+// The first attribute contains the keys sorted in ascending order and the
+// second attribute the values in the same multi-value position. The values of
+// a key added several times are concatenated in the order they were added.
+// Keys and values are appended in one buffer and the dynamic array is only
+// assembled once by dynarray_builder_finish. All the memory is taken from the
+// arena of the request.
+
+// Types
+
+struct dynarray_entry_struct {
+   const char  *key;          // Only set by dynarray_builder_finish
+   size_t       key_offset;
+   size_t       key_length;
+   size_t       value_offset;
+   size_t       value_length;
+   unsigned int entry_number;
+};
+
+// Declarations
+
+static bool builder_reserve_storage (struct dynarray_builder_struct *dynarray_builder, size_t add_length);
+static int compare_entry (const void *first_entry, const void *second_entry);
+static bool same_key (const struct dynarray_entry_struct *first, const struct dynarray_entry_struct *second);
+
+// Constants
+
+static const size_t builder_initial_storage = 1024;
+static const size_t builder_initial_entries = 16;
+
+// Functions
+
+void dynarray_builder_init (struct dynarray_builder_struct *dynarray_builder, struct ohs_arena_struct *arena)
+{
+   dynarray_builder->arena = arena;
+   dynarray_builder->storage = NULL;
+   dynarray_builder->storage_length = 0;
+   dynarray_builder->storage_size = 0;
+   dynarray_builder->entries = NULL;
+   dynarray_builder->entry_length = 0;
+   dynarray_builder->entry_size = 0;
+}
+
+void dynarray_builder_free (struct dynarray_builder_struct *dynarray_builder)
+{
+   // The memory is released with the arena
+   dynarray_builder_init (dynarray_builder, dynarray_builder->arena);
+}
+
+size_t dynarray_builder_length (const struct dynarray_builder_struct *dynarray_builder)
+{
+   // Upper bound of the dynamic array length, a mark after each key and value
+   return dynarray_builder->storage_length + dynarray_builder->entry_length * 2;
+}
+
+bool builder_reserve_storage (struct dynarray_builder_struct *dynarray_builder, size_t add_length)
+{
+   if (dynarray_builder->storage_length + add_length > dynarray_builder->storage_size) {
+      size_t new_size = dynarray_builder->storage_size ? dynarray_builder->storage_size : builder_initial_storage;
+
+      while (new_size < dynarray_builder->storage_length + add_length) {
+         new_size *= 2;
+      }
+
+      char *new_storage = ohs_arena_alloc (dynarray_builder->arena, new_size);
+
+      if (new_storage == NULL) {
+         return false;
+      }
+      if (dynarray_builder->storage_length) {
+         memcpy (new_storage, dynarray_builder->storage, dynarray_builder->storage_length);
+      }
+      dynarray_builder->storage = new_storage;
+      dynarray_builder->storage_size = new_size;
+   }
+   if (dynarray_builder->entry_length == dynarray_builder->entry_size) {
+      size_t new_size = dynarray_builder->entry_size ? dynarray_builder->entry_size * 2 : builder_initial_entries;
+      struct dynarray_entry_struct *new_entries = ohs_arena_alloc (dynarray_builder->arena, new_size * sizeof (struct dynarray_entry_struct));
+
+      if (new_entries == NULL) {
+         return false;
+      }
+      if (dynarray_builder->entry_length) {
+         memcpy (new_entries, dynarray_builder->entries, dynarray_builder->entry_length * sizeof (struct dynarray_entry_struct));
+      }
+      dynarray_builder->entries = new_entries;
+      dynarray_builder->entry_size = new_size;
+   }
+   return true;
+}
+
+bool dynarray_builder_add (struct dynarray_builder_struct *dynarray_builder, const char *key, const char *value, size_t value_length)
+{
+   size_t key_length = strlen (key);
+
+   if (value == NULL) {
+      value_length = 0;
+   }
+   if (!builder_reserve_storage (dynarray_builder, key_length + value_length)) {
+      return false;
+   }
+
+   struct dynarray_entry_struct *entry = &dynarray_builder->entries [dynarray_builder->entry_length];
+
+   entry->key_offset = dynarray_builder->storage_length;
+   entry->key_length = key_length;
+   memcpy (dynarray_builder->storage + dynarray_builder->storage_length, key, key_length);
+   dynarray_builder->storage_length += key_length;
+   entry->value_offset = dynarray_builder->storage_length;
+   entry->value_length = value_length;
+   if (value_length) {
+      memcpy (dynarray_builder->storage + dynarray_builder->storage_length, value, value_length);
+      dynarray_builder->storage_length += value_length;
+   }
+   entry->entry_number = dynarray_builder->entry_length++;
+   return true;
+}
+
+int compare_entry (const void *first_entry, const void *second_entry)
+{
+   const struct dynarray_entry_struct *first = first_entry;
+   const struct dynarray_entry_struct *second = second_entry;
+   size_t common_length = first->key_length < second->key_length ? first->key_length : second->key_length;
+   int compare_status = memcmp (first->key, second->key, common_length);
+
+   if (compare_status == 0) {
+      if (first->key_length != second->key_length) {
+         return first->key_length < second->key_length ? -1 : 1;
+      }
+      // Same key, keep the order the values were added
+      return first->entry_number < second->entry_number ? -1 : 1;
+   }
+   return compare_status;
+}
+
+bool same_key (const struct dynarray_entry_struct *first, const struct dynarray_entry_struct *second)
+{
+   return first->key_length == second->key_length && memcmp (first->key, second->key, first->key_length) == 0;
+}
+
+char *dynarray_builder_finish (struct dynarray_builder_struct *dynarray_builder)
+{
+   char *dynarray = ohs_arena_alloc (dynarray_builder->arena, dynarray_builder_length (dynarray_builder) + 1);
+
+   if (dynarray == NULL) {
+      dynarray_builder_free (dynarray_builder);
+      return NULL;
+   }
+   if (dynarray_builder->entry_length == 0) {
+      *dynarray = '\0';
+      dynarray_builder_free (dynarray_builder);
+      return dynarray;
+   }
+
+   struct dynarray_entry_struct *entries = dynarray_builder->entries;
+   size_t entry_length = dynarray_builder->entry_length;
+
+   // The storage doesn't move anymore, the keys can be compared directly
+   for (size_t entry_index = 0 ; entry_index < entry_length ; ++entry_index) {
+      entries [entry_index].key = dynarray_builder->storage + entries [entry_index].key_offset;
+   }
+   qsort (entries, entry_length, sizeof (struct dynarray_entry_struct), &compare_entry);
+
+   // Keys
+   char *dynarray_end = dynarray;
+
+   for (size_t entry_index = 0 ; entry_index < entry_length ; ++entry_index) {
+      if (entry_index) {
+         if (same_key (&entries [entry_index], &entries [entry_index - 1])) {
+            continue;
+         }
+         *dynarray_end++ = VALUE_MARK;
+      }
+      memcpy (dynarray_end, dynarray_builder->storage + entries [entry_index].key_offset, entries [entry_index].key_length);
+      dynarray_end += entries [entry_index].key_length;
+   }
+   *dynarray_end++ = FIELD_MARK;
+
+   // Values, concatenated for the same key
+   for (size_t entry_index = 0 ; entry_index < entry_length ; ++entry_index) {
+      if (entry_index && !same_key (&entries [entry_index], &entries [entry_index - 1])) {
+         *dynarray_end++ = VALUE_MARK;
+      }
+      memcpy (dynarray_end, dynarray_builder->storage + entries [entry_index].value_offset, entries [entry_index].value_length);
+      dynarray_end += entries [entry_index].value_length;
+   }
+   *dynarray_end = '\0';
+   dynarray_builder_free (dynarray_builder);
+   return dynarray;
+}
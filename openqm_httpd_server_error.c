@@ -0,0 +1,284 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "openqm_httpd_server.h"
+
+// Error pages generated by the server.
+// The pages of the known statuses are built once at startup in html, json and
+// xml from the templates of httpd.error_html, httpd.error_json and
+// httpd.error_xml, where {status} and {message} are replaced. They are kept
+// as persistent responses and the format is chosen from the Accept header of
+// the request, so an error page costs no allocation. Only the unknown
+// statuses are built for the request, in its arena.
+
+// Sizes
+
+#define ERROR_STATUS_COUNT 8
+
+// Types
+
+enum error_format_enum {
+   ef_html,
+   ef_json,
+   ef_xml,
+   ef_count
+};
+
+struct error_status_struct {
+   unsigned int  status_code;
+   const char   *message;
+};
+
+// Declarations
+
+static size_t error_page_render (char *page, const char *page_template, unsigned int status_code, const char *message);
+static enum error_format_enum error_format_negotiate (struct MHD_Connection *connection);
+static struct MHD_Response *error_response_create (char *page, size_t page_length, enum error_format_enum error_format, enum MHD_ResponseMemoryMode memory_mode);
+
+// Constants
+
+static const struct error_status_struct error_statuses [ERROR_STATUS_COUNT] = {
+   { MHD_HTTP_BAD_REQUEST,            "Bad request" },
+   { MHD_HTTP_FORBIDDEN,              "Forbidden" },
+   { MHD_HTTP_NOT_FOUND,              "Page not found" },
+   { MHD_HTTP_METHOD_NOT_ALLOWED,     "Method not allowed" },
+   { MHD_HTTP_PAYLOAD_TOO_LARGE,      "Payload too large" },
+   { MHD_HTTP_UNSUPPORTED_MEDIA_TYPE, "Unsupported media type" },
+   { MHD_HTTP_INTERNAL_SERVER_ERROR,  "Internal server error" },
+   { MHD_HTTP_SERVICE_UNAVAILABLE,    "Service unavailable" }
+};
+static const char *error_content_types [ef_count] = {
+   "text/html; charset=utf-8",
+   "application/json",
+   "application/xml; charset=utf-8"
+};
+static const char *error_default_templates [ef_count] = {
+   "<html><head><title>Error</title></head><body><p>{message}</p></body></html>",
+   "{\"status\":{status},\"error\":\"{message}\"}",
+   "<?xml version=\"1.0\" encoding=\"utf-8\"?><error><status>{status}</status><message>{message}</message></error>"
+};
+
+// Globals variables
+
+static const char *error_templates [ef_count];
+static char *error_pages [ERROR_STATUS_COUNT][ef_count];
+static size_t error_page_lengths [ERROR_STATUS_COUNT][ef_count];
+static struct MHD_Response *error_responses [ERROR_STATUS_COUNT][ef_count];
+
+// Functions
+
+size_t error_page_render (char *page, const char *page_template, unsigned int status_code, const char *message)
+{
+   // Length of the page without the final 0, page can be NULL to get it
+   char status_string [16];
+   size_t status_length = snprintf (status_string, sizeof (status_string), "%u", status_code);
+   size_t message_length = strlen (message);
+   size_t page_length = 0;
+
+   while (*page_template != '\0') {
+      if (strncmp (page_template, "{status}", 8) == 0) {
+         if (page != NULL) {
+            memcpy (page + page_length, status_string, status_length);
+         }
+         page_length += status_length;
+         page_template += 8;
+      }
+      else if (strncmp (page_template, "{message}", 9) == 0) {
+         if (page != NULL) {
+            memcpy (page + page_length, message, message_length);
+         }
+         page_length += message_length;
+         page_template += 9;
+      }
+      else {
+         if (page != NULL) {
+            page [page_length] = *page_template;
+         }
+         ++page_length;
+         ++page_template;
+      }
+   }
+   if (page != NULL) {
+      page [page_length] = '\0';
+   }
+   return page_length;
+}
+
+enum error_format_enum error_format_negotiate (struct MHD_Connection *connection)
+{
+   // Format of the best quality in Accept, html when none is given
+   const char *accept = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT);
+   double format_qualities [ef_count] = { -1, -1, -1 };
+   double wildcard_quality = -1;
+
+   if (accept == NULL) {
+      return ef_html;
+   }
+   while (*accept != '\0') {
+      while (*accept == ' ' || *accept == '\t' || *accept == ',') {
+         ++accept;
+      }
+
+      size_t media_length = strcspn (accept, ",; \t");
+      const char *parameters = accept + media_length;
+      const char *media = accept;
+      double media_quality = 1;
+      int media_format = -1;
+
+      accept = parameters + strcspn (parameters, ",");
+
+      const char *q_parameter = strstr (parameters, "q=");
+
+      if (q_parameter != NULL && q_parameter < accept) {
+         media_quality = strtod (q_parameter + 2, NULL);
+      }
+      if ((media_length == 9 && strncasecmp (media, "text/html", 9) == 0)
+          || (media_length == 21 && strncasecmp (media, "application/xhtml+xml", 21) == 0)) {
+         media_format = ef_html;
+      }
+      else if ((media_length == 16 && strncasecmp (media, "application/json", 16) == 0)
+               || (media_length > 5 && strncasecmp (media + media_length - 5, "+json", 5) == 0)) {
+         media_format = ef_json;
+      }
+      else if ((media_length == 15 && strncasecmp (media, "application/xml", 15) == 0)
+               || (media_length == 8 && strncasecmp (media, "text/xml", 8) == 0)
+               || (media_length > 4 && strncasecmp (media + media_length - 4, "+xml", 4) == 0)) {
+         media_format = ef_xml;
+      }
+      else if ((media_length == 3 && strncmp (media, "*/*", 3) == 0)
+               || (media_length == 6 && strncasecmp (media, "text/*", 6) == 0)) {
+         if (media_quality > wildcard_quality) {
+            wildcard_quality = media_quality;
+         }
+      }
+      if (media_format >= 0 && media_quality > format_qualities [media_format]) {
+         format_qualities [media_format] = media_quality;
+      }
+   }
+   if (format_qualities [ef_html] < 0) {
+      format_qualities [ef_html] = wildcard_quality;
+   }
+
+   enum error_format_enum error_format = ef_html;
+
+   // html on a tie
+   for (enum error_format_enum format_index = ef_json ; format_index < ef_count ; ++format_index) {
+      if (format_qualities [format_index] > format_qualities [error_format]) {
+         error_format = format_index;
+      }
+   }
+   return error_format;
+}
+
+struct MHD_Response *error_response_create (char *page, size_t page_length, enum error_format_enum error_format, enum MHD_ResponseMemoryMode memory_mode)
+{
+   struct MHD_Response *response = MHD_create_response_from_buffer (page_length, page, memory_mode);
+
+   if (response == NULL) {
+      abort_message ("Can't create buffer for default error page");
+   }
+   else {
+      MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, error_content_types [error_format]);
+      MHD_add_response_header (response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT);
+   }
+   return response;
+}
+
+bool ohs_error_init ()
+{
+   // Before the workers are started, they inherit the responses
+   error_templates [ef_html] = config_http_error_html;
+   error_templates [ef_json] = config_http_error_json;
+   error_templates [ef_xml] = config_http_error_xml;
+   for (enum error_format_enum error_format = ef_html ; error_format < ef_count ; ++error_format) {
+      if (error_templates [error_format] == NULL) {
+         error_templates [error_format] = error_default_templates [error_format];
+      }
+   }
+   for (int status_index = 0 ; status_index < ERROR_STATUS_COUNT ; ++status_index) {
+      for (enum error_format_enum error_format = ef_html ; error_format < ef_count ; ++error_format) {
+         size_t page_length = error_page_render (NULL, error_templates [error_format], error_statuses [status_index].status_code, error_statuses [status_index].message);
+
+         error_pages [status_index][error_format] = malloc (page_length + 1);
+         if (error_pages [status_index][error_format] == NULL) {
+            fprintf (stderr, "Full memory when building the error pages\n");
+            return false;
+         }
+         error_page_render (error_pages [status_index][error_format], error_templates [error_format], error_statuses [status_index].status_code, error_statuses [status_index].message);
+         error_page_lengths [status_index][error_format] = page_length;
+         error_responses [status_index][error_format] = error_response_create (error_pages [status_index][error_format], page_length, error_format, MHD_RESPMEM_PERSISTENT);
+         if (error_responses [status_index][error_format] == NULL) {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+void ohs_error_free ()
+{
+   for (int status_index = 0 ; status_index < ERROR_STATUS_COUNT ; ++status_index) {
+      for (enum error_format_enum error_format = ef_html ; error_format < ef_count ; ++error_format) {
+         if (error_responses [status_index][error_format] != NULL) {
+            MHD_destroy_response (error_responses [status_index][error_format]);
+            error_responses [status_index][error_format] = NULL;
+         }
+         free (error_pages [status_index][error_format]);
+         error_pages [status_index][error_format] = NULL;
+      }
+   }
+}
+
+struct MHD_Response *ohs_error_response (struct MHD_Connection *connection, struct ohs_arena_struct *arena, unsigned int status_code, size_t *page_length)
+{
+   // The response must be released with ohs_response_destroy
+   enum error_format_enum error_format = error_format_negotiate (connection);
+
+   for (int status_index = 0 ; status_index < ERROR_STATUS_COUNT ; ++status_index) {
+      if (error_statuses [status_index].status_code == status_code && error_responses [status_index][error_format] != NULL) {
+         *page_length = error_page_lengths [status_index][error_format];
+         return error_responses [status_index][error_format];
+      }
+   }
+
+   char error_message [64];
+   char page_buffer [1024];
+   char *page_to_send;
+
+   snprintf (error_message, sizeof (error_message), "Unknown error %u", status_code);
+   *page_length = error_page_render (NULL, error_templates [error_format], status_code, error_message);
+   // Without arena, MHD keeps its own copy of the page
+   page_to_send = arena != NULL ? ohs_arena_alloc (arena, *page_length + 1) : *page_length < sizeof (page_buffer) ? page_buffer : NULL;
+   if (page_to_send == NULL) {
+      abort_message ("Full memory when generate default error page");
+      return NULL;
+   }
+   error_page_render (page_to_send, error_templates [error_format], status_code, error_message);
+   return error_response_create (page_to_send, *page_length, error_format, arena == NULL ? MHD_RESPMEM_MUST_COPY : MHD_RESPMEM_PERSISTENT);
+}
+
+bool ohs_error_response_shared (const struct MHD_Response *response)
+{
+   // The responses built at startup are never destroyed by the requests
+   for (int status_index = 0 ; status_index < ERROR_STATUS_COUNT ; ++status_index) {
+      for (enum error_format_enum error_format = ef_html ; error_format < ef_count ; ++error_format) {
+         if (error_responses [status_index][error_format] == response) {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+void ohs_response_destroy (struct MHD_Response *response)
+{
+   if (!ohs_error_response_shared (response)) {
+      MHD_destroy_response (response);
+   }
+}
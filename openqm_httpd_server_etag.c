@@ -0,0 +1,127 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "openqm_httpd_server.h"
+
+// Validators of the responses.
+// The ETag is a 64 bits FNV-1a of the body when the route asks for it, or
+// the ETag and Last-Modified given by the routine in header_out. A GET whose
+// If-None-Match (or If-Modified-Since without If-None-Match) matches them is
+// answered by a 304 without body. The responses in cache keep their
+// validators so a conditional request can be answered without calling the
+// routine.
+
+// Declarations
+
+static bool etag_list_match (const char *if_none_match, const char *etag);
+static bool etag_not_modified (struct MHD_Connection *connection, struct MHD_Response *response);
+
+// Constants
+
+// Headers of the full response repeated in the 304 (RFC 7232 4.1)
+static const char *etag_not_modified_headers [] = {
+   MHD_HTTP_HEADER_CACHE_CONTROL,
+   MHD_HTTP_HEADER_CONTENT_LOCATION,
+   MHD_HTTP_HEADER_ETAG,
+   MHD_HTTP_HEADER_EXPIRES,
+   MHD_HTTP_HEADER_LAST_MODIFIED,
+   MHD_HTTP_HEADER_VARY
+};
+
+// Functions
+
+bool etag_list_match (const char *if_none_match, const char *etag)
+{
+   // Weak comparison, W/ is ignored on both sides
+   size_t etag_length;
+
+   if (strncmp (etag, "W/", 2) == 0) {
+      etag += 2;
+   }
+   etag_length = strlen (etag);
+   while (*if_none_match != '\0') {
+      while (*if_none_match == ' ' || *if_none_match == '\t' || *if_none_match == ',') {
+         ++if_none_match;
+      }
+      if (*if_none_match == '*') {
+         return true;
+      }
+      if (strncmp (if_none_match, "W/", 2) == 0) {
+         if_none_match += 2;
+      }
+
+      size_t tag_length = strcspn (if_none_match, ", \t");
+
+      if (tag_length == etag_length && strncmp (if_none_match, etag, etag_length) == 0) {
+         return true;
+      }
+      if_none_match += tag_length;
+   }
+   return false;
+}
+
+bool etag_not_modified (struct MHD_Connection *connection, struct MHD_Response *response)
+{
+   const char *if_none_match = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+
+   if (if_none_match != NULL) {
+      const char *etag = MHD_get_response_header (response, MHD_HTTP_HEADER_ETAG);
+
+      return etag != NULL && etag_list_match (if_none_match, etag);
+   }
+
+   // The date sent back by the client is the Last-Modified it received
+   const char *if_modified_since = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+
+   if (if_modified_since != NULL) {
+      const char *last_modified = MHD_get_response_header (response, MHD_HTTP_HEADER_LAST_MODIFIED);
+
+      return last_modified != NULL && strcmp (if_modified_since, last_modified) == 0;
+   }
+   return false;
+}
+
+void ohs_etag_compute (const char *body, size_t body_length, char *etag)
+{
+   // etag must have OHS_ETAG_SIZE bytes
+   uint64_t hash = 14695981039346656037ull;
+
+   for (size_t body_index = 0 ; body_index < body_length ; ++body_index) {
+      hash ^= (unsigned char) body [body_index];
+      hash *= 1099511628211ull;
+   }
+   snprintf (etag, OHS_ETAG_SIZE, "\"%016llx\"", (unsigned long long) hash);
+}
+
+int ohs_etag_queue_response (struct MHD_Connection *connection, unsigned int *http_status, size_t *body_length, struct MHD_Response *response)
+{
+   // Queue the response of a GET, or a 304 when the client already has it,
+   // http_status and body_length are updated with the response sent
+   if (*http_status != MHD_HTTP_OK || !etag_not_modified (connection, response)) {
+      return MHD_queue_response (connection, *http_status, response);
+   }
+
+   struct MHD_Response *not_modified_response = MHD_create_response_from_buffer (0, "", MHD_RESPMEM_PERSISTENT);
+   int return_status;
+
+   if (not_modified_response == NULL) {
+      return MHD_queue_response (connection, *http_status, response);
+   }
+   for (int header_index = 0 ; header_index < sizeof (etag_not_modified_headers) / sizeof (etag_not_modified_headers [0]) ; ++header_index) {
+      const char *header_value = MHD_get_response_header (response, etag_not_modified_headers [header_index]);
+
+      if (header_value != NULL) {
+         MHD_add_response_header (not_modified_response, etag_not_modified_headers [header_index], header_value);
+      }
+   }
+   *http_status = MHD_HTTP_NOT_MODIFIED;
+   *body_length = 0;
+   return_status = MHD_queue_response (connection, *http_status, not_modified_response);
+   MHD_destroy_response (not_modified_response);
+   return return_status;
+}
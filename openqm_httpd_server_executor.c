@@ -0,0 +1,106 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "openqm_httpd_server.h"
+
+// Executor of the OpenQM calls.
+// The MHD threads suspend the connection and queue a job, a single thread
+// executes the jobs because the QM client library isn't thread safe. The job
+// function resumes the connection when its result is ready.
+
+// Declarations
+
+static void *executor_thread (void *arg);
+
+// Globals variables
+
+static pthread_mutex_t executor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t executor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t executor_thread_id;
+static struct ohs_job_struct *executor_first_job = NULL;
+static struct ohs_job_struct *executor_last_job = NULL;
+static bool executor_running = false;
+
+// Functions
+
+void *executor_thread (void *arg)
+{
+   pthread_mutex_lock (&executor_mutex);
+   for (;;) {
+      while (executor_first_job == NULL && executor_running) {
+         pthread_cond_wait (&executor_cond, &executor_mutex);
+      }
+      if (executor_first_job == NULL) {
+         // Stopped and all the queued jobs are done
+         break;
+      }
+
+      struct ohs_job_struct *job = executor_first_job;
+
+      executor_first_job = job->next;
+      if (executor_first_job == NULL) {
+         executor_last_job = NULL;
+      }
+      job->next = NULL;
+      pthread_mutex_unlock (&executor_mutex);
+      job->job_function (job->job_cls);
+      pthread_mutex_lock (&executor_mutex);
+   }
+   pthread_mutex_unlock (&executor_mutex);
+   return NULL;
+}
+
+bool ohs_executor_start ()
+{
+   executor_running = true;
+   if (pthread_create (&executor_thread_id, NULL, &executor_thread, NULL) != 0) {
+      abort_message ("Can't start executor thread");
+      executor_running = false;
+      return false;
+   }
+   return true;
+}
+
+bool ohs_executor_submit (struct ohs_job_struct *job, struct MHD_Connection *connection)
+{
+   pthread_mutex_lock (&executor_mutex);
+   if (!executor_running) {
+      pthread_mutex_unlock (&executor_mutex);
+      abort_message ("Executor stopped, job refused");
+      return false;
+   }
+   // Suspend before queueing so the job can't resume the connection first
+   if (connection != NULL) {
+      MHD_suspend_connection (connection);
+   }
+   job->next = NULL;
+   if (executor_last_job == NULL) {
+      executor_first_job = job;
+   }
+   else {
+      executor_last_job->next = job;
+   }
+   executor_last_job = job;
+   pthread_cond_signal (&executor_cond);
+   pthread_mutex_unlock (&executor_mutex);
+   return true;
+}
+
+void ohs_executor_stop ()
+{
+   pthread_mutex_lock (&executor_mutex);
+   if (!executor_running) {
+      pthread_mutex_unlock (&executor_mutex);
+      return;
+   }
+   executor_running = false;
+   pthread_cond_signal (&executor_cond);
+   pthread_mutex_unlock (&executor_mutex);
+   // Queued jobs are still executed so no connection stays suspended
+   pthread_join (executor_thread_id, NULL);
+}
@@ -0,0 +1,210 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openqm_httpd_server.h"
+
+// Coalescing of the identical GET requests of the routes with coalesce.
+// The first request of a key (the leader) calls the routine, the identical
+// requests received meanwhile (the followers) are suspended until its
+// response is ready and then send the same MHD response. The flight keeps the
+// reference given by the creation of the response, the last follower
+// destroys it. When the response of the leader can't be shared (error page,
+// continuation...) the followers call the routine themselves.
+
+// Types
+
+struct flight_struct {
+   struct flight_struct          *hash_next;
+   unsigned int                   hash;
+   const char                    *key;               // Key of the leader
+   size_t                         key_length;
+   struct connection_info_struct *first_follower;    // Until the landing
+   int                            follower_length;
+   unsigned int                   http_status;
+   size_t                         body_length;
+   struct MHD_Response           *response;          // NULL when not shared
+   bool                           landed;
+};
+
+// Declarations
+
+static unsigned int flight_hash (const char *key, size_t key_length);
+static void flight_unlink (struct flight_struct *flight);
+static void flight_leave (struct flight_struct *flight);
+
+// Constants
+
+#define FLIGHT_BUCKET_COUNT 256
+
+// Globals variables
+
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct flight_struct *flight_buckets [FLIGHT_BUCKET_COUNT];
+
+// Functions
+
+unsigned int flight_hash (const char *key, size_t key_length)
+{
+   // FNV-1a
+   unsigned int hash = 2166136261u;
+
+   for (size_t key_index = 0 ; key_index < key_length ; ++key_index) {
+      hash ^= (unsigned char) key [key_index];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+void flight_unlink (struct flight_struct *flight)
+{
+   struct flight_struct **bucket_flight = &flight_buckets [flight->hash & (FLIGHT_BUCKET_COUNT - 1)];
+
+   while (*bucket_flight != flight) {
+      bucket_flight = &(*bucket_flight)->hash_next;
+   }
+   *bucket_flight = flight->hash_next;
+}
+
+void flight_leave (struct flight_struct *flight)
+{
+   // Called with flight_mutex locked, once by each follower
+   if (--flight->follower_length == 0 && flight->landed) {
+      if (flight->response != NULL) {
+         MHD_destroy_response (flight->response);
+      }
+      free (flight);
+   }
+}
+
+bool ohs_flight_join (struct connection_info_struct *connection_info)
+{
+   // Returns true when the request follows a flight, its connection is then
+   // suspended until the landing
+   unsigned int hash = flight_hash (connection_info->cache_key, connection_info->cache_key_length);
+
+   pthread_mutex_lock (&flight_mutex);
+
+   struct flight_struct *flight = flight_buckets [hash & (FLIGHT_BUCKET_COUNT - 1)];
+
+   while (flight != NULL && !(flight->hash == hash && flight->key_length == connection_info->cache_key_length && memcmp (flight->key, connection_info->cache_key, flight->key_length) == 0)) {
+      flight = flight->hash_next;
+   }
+   if (flight != NULL) {
+      connection_info->flight = flight;
+      connection_info->flight_next = flight->first_follower;
+      connection_info->call_state = cs_following;
+      flight->first_follower = connection_info;
+      ++flight->follower_length;
+      MHD_suspend_connection (connection_info->connection);
+      pthread_mutex_unlock (&flight_mutex);
+      return true;
+   }
+
+   // Leader, the key stays in its arena until the landing
+   flight = malloc (sizeof (struct flight_struct));
+   if (flight != NULL) {
+      flight->hash = hash;
+      flight->key = connection_info->cache_key;
+      flight->key_length = connection_info->cache_key_length;
+      flight->first_follower = NULL;
+      flight->follower_length = 0;
+      flight->http_status = 0;
+      flight->body_length = OHS_BODY_LENGTH_UNKNOWN;
+      flight->response = NULL;
+      flight->landed = false;
+      flight->hash_next = flight_buckets [hash & (FLIGHT_BUCKET_COUNT - 1)];
+      flight_buckets [hash & (FLIGHT_BUCKET_COUNT - 1)] = flight;
+      connection_info->flight = flight;
+   }
+   pthread_mutex_unlock (&flight_mutex);
+   return false;
+}
+
+int ohs_flight_land (struct connection_info_struct *connection_info, unsigned int http_status, struct MHD_Response *response, bool response_shared)
+{
+   // Sends the response of the leader and gives it to its followers
+   struct flight_struct *flight = connection_info->flight;
+   size_t body_length = connection_info->response_body_length;
+   int return_status = MHD_NO;
+
+   if (response != NULL) {
+      connection_info->http_status = http_status;
+      return_status = ohs_etag_queue_response (connection_info->connection, &connection_info->http_status, &connection_info->response_body_length, response);
+   }
+
+   pthread_mutex_lock (&flight_mutex);
+   flight_unlink (flight);
+   connection_info->flight = NULL;
+   if (flight->follower_length == 0 || !response_shared) {
+      if (response != NULL) {
+         ohs_response_destroy (response);
+      }
+      response = NULL;
+   }
+   flight->http_status = http_status;
+   flight->body_length = body_length;
+   flight->response = response;
+   flight->landed = true;
+   for (struct connection_info_struct *follower = flight->first_follower ; follower != NULL ; follower = follower->flight_next) {
+      MHD_resume_connection (follower->connection);
+   }
+   flight->first_follower = NULL;
+   if (flight->follower_length == 0) {
+      free (flight);
+   }
+   pthread_mutex_unlock (&flight_mutex);
+   return return_status;
+}
+
+int ohs_flight_follow (struct connection_info_struct *connection_info)
+{
+   // Back from the suspension, -1 when the routine must be called
+   struct flight_struct *flight = connection_info->flight;
+   int return_status = -1;
+
+   pthread_mutex_lock (&flight_mutex);
+   if (flight->response != NULL) {
+      connection_info->http_status = flight->http_status;
+      connection_info->response_body_length = flight->body_length;
+      return_status = ohs_etag_queue_response (connection_info->connection, &connection_info->http_status, &connection_info->response_body_length, flight->response);
+   }
+   connection_info->flight = NULL;
+   flight_leave (flight);
+   pthread_mutex_unlock (&flight_mutex);
+   return return_status;
+}
+
+void ohs_flight_cancel (struct connection_info_struct *connection_info)
+{
+   // Request terminated before the landing (client gone, daemon stopped)
+   struct flight_struct *flight = connection_info->flight;
+
+   if (flight == NULL) {
+      return;
+   }
+   if (connection_info->call_state != cs_following) {
+      // Leader, its followers call the routine themselves
+      ohs_flight_land (connection_info, 0, NULL, false);
+      return;
+   }
+   pthread_mutex_lock (&flight_mutex);
+   if (flight->first_follower != NULL) {
+      // Not landed, the follower is removed from the list
+      struct connection_info_struct **follower = &flight->first_follower;
+
+      while (*follower != NULL && *follower != connection_info) {
+         follower = &(*follower)->flight_next;
+      }
+      if (*follower != NULL) {
+         *follower = connection_info->flight_next;
+      }
+   }
+   connection_info->flight = NULL;
+   flight_leave (flight);
+   pthread_mutex_unlock (&flight_mutex);
+}
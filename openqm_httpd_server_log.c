@@ -0,0 +1,166 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "openqm_httpd_server.h"
+
+// Leveled log in syslog.
+// The level of httpd.log_level is checked before formatting, the debug
+// messages cost a test of ohs_log_level when they aren't written. SIGUSR2
+// switches between the configured level and debug, the master forwards it to
+// the workers. The error messages of abort_message are limited by message:
+// beyond httpd.log_rate_limit identical messages in a second they are counted
+// and only their number is written, when the message comes back, when its
+// slot is reused or by ohs_log_rate_flush which the workers call every second.
+
+// Sizes
+
+#define LOG_RATE_SLOT_COUNT 64
+#define LOG_RATE_MESSAGE_SIZE 160
+
+// Types
+
+struct log_rate_struct {
+   unsigned int  message_hash;
+   time_t        window_start;
+   unsigned long message_count;   // In the window
+   unsigned long dropped_count;   // Since the last message written
+   char          message [LOG_RATE_MESSAGE_SIZE]; // Cut off, for the count of the dropped ones
+};
+
+// Declarations
+
+static unsigned int log_message_hash (const char *message);
+
+// Constants
+
+static const char *log_level_names [] = {
+   "emerg",
+   "alert",
+   "crit",
+   "error",
+   "warning",
+   "notice",
+   "info",
+   "debug"
+};
+
+// Globals variables
+
+volatile int ohs_log_level = LOG_INFO;
+static int log_level_configured = LOG_INFO;
+static pthread_mutex_t log_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_rate_struct log_rates [LOG_RATE_SLOT_COUNT];
+
+// Functions
+
+unsigned int log_message_hash (const char *message)
+{
+   unsigned int hash = 2166136261u;
+
+   for (; *message != '\0' ; ++message) {
+      hash ^= (unsigned char) *message;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+int ohs_log_level_value (const char *level_name)
+{
+   // -1 when the name is unknown
+   for (int level = LOG_EMERG ; level <= LOG_DEBUG ; ++level) {
+      if (strcasecmp (level_name, log_level_names [level]) == 0) {
+         return level;
+      }
+   }
+   return -1;
+}
+
+void ohs_log_init (int level)
+{
+   log_level_configured = level;
+   ohs_log_level = level;
+}
+
+void ohs_log_toggle ()
+{
+   // Called by the loops of the master and of the workers on SIGUSR2
+   ohs_log_level = ohs_log_level == LOG_DEBUG ? log_level_configured : LOG_DEBUG;
+}
+
+void ohs_log (int level, const char *format, ...)
+{
+   va_list format_args;
+
+   if (level > ohs_log_level) {
+      return;
+   }
+   va_start (format_args, format);
+   vsyslog (LOG_USER | level, format, format_args);
+   va_end (format_args);
+}
+
+bool ohs_log_rate_allow (const char *message)
+{
+   // false when the message must not be written
+   if (config_http_log_rate_limit == 0) {
+      return true;
+   }
+
+   unsigned int message_hash = log_message_hash (message);
+   struct log_rate_struct *log_rate = &log_rates [message_hash % LOG_RATE_SLOT_COUNT];
+   time_t now = time (NULL);
+   unsigned long dropped_count = 0;
+   char dropped_message [LOG_RATE_MESSAGE_SIZE];
+   bool allowed = true;
+
+   pthread_mutex_lock (&log_rate_mutex);
+   if (log_rate->message_hash != message_hash || log_rate->window_start != now) {
+      // Count of the previous window, even when the slot goes to another message
+      dropped_count = log_rate->dropped_count;
+      if (dropped_count != 0) {
+         memcpy (dropped_message, log_rate->message, sizeof (dropped_message));
+      }
+      if (log_rate->message_hash != message_hash) {
+         snprintf (log_rate->message, sizeof (log_rate->message), "%s", message);
+      }
+      log_rate->message_hash = message_hash;
+      log_rate->window_start = now;
+      log_rate->message_count = 0;
+      log_rate->dropped_count = 0;
+   }
+   if (++log_rate->message_count > config_http_log_rate_limit) {
+      ++log_rate->dropped_count;
+      allowed = false;
+   }
+   pthread_mutex_unlock (&log_rate_mutex);
+   if (dropped_count != 0) {
+      ohs_log (LOG_WARNING, "Message dropped %lu times: %s", dropped_count, dropped_message);
+   }
+   return allowed;
+}
+
+void ohs_log_rate_flush ()
+{
+   // Counts of the windows ended, so the end of a flood isn't lost
+   time_t now = time (NULL);
+
+   pthread_mutex_lock (&log_rate_mutex);
+   for (int slot_index = 0 ; slot_index < LOG_RATE_SLOT_COUNT ; ++slot_index) {
+      struct log_rate_struct *log_rate = &log_rates [slot_index];
+
+      if (log_rate->dropped_count != 0 && log_rate->window_start != now) {
+         ohs_log (LOG_WARNING, "Message dropped %lu times: %s", log_rate->dropped_count, log_rate->message);
+         log_rate->dropped_count = 0;
+      }
+   }
+   pthread_mutex_unlock (&log_rate_mutex);
+}
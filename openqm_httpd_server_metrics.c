@@ -0,0 +1,443 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "openqm_httpd_server.h"
+
+// Metrics in the Prometheus text format on httpd.metrics_path.
+// Each worker counts in its own slot of a memory shared by all the workers,
+// with atomic additions and without lock. The worker which answers the
+// scraping adds the slots of all the workers, the counters aren't reset when
+// a worker is respawned. The subroutines are numbered when the routes are
+// compiled, before the workers are started. The buffer pools and the cache
+// publish their state in the slot, the buffer pools are given by worker. The
+// metrics are only answered with httpd.metrics_token or on the unix socket
+// with httpd.socket_admin, like the administration urls.
+
+// Sizes
+
+#define METRICS_SUBR_MAX 128
+#define METRICS_BUCKET_COUNT 12
+#define METRICS_STATUS_CLASS_COUNT 6
+#define METRICS_ERROR_PAGE_COUNT 8
+
+// Types
+
+struct metrics_histogram_struct {
+   unsigned long buckets [METRICS_BUCKET_COUNT];  // Not cumulated
+   unsigned long count;
+   unsigned long sum;                             // Microseconds or bytes
+};
+
+struct metrics_worker_struct {
+   unsigned long                   requests [METRICS_SUBR_MAX][METRICS_STATUS_CLASS_COUNT];
+   struct metrics_histogram_struct request_duration [METRICS_SUBR_MAX];
+   struct metrics_histogram_struct qmcall_duration;
+   struct metrics_histogram_struct qm_connect_duration;
+   struct metrics_histogram_struct request_body_size;
+   struct metrics_histogram_struct response_body_size;
+   unsigned long                   error_pages [METRICS_ERROR_PAGE_COUNT];
+   struct ohs_buffer_stats_struct  buffer_stats [bp_count];  // Gauges, not summed
+   unsigned long                   cache_hits;
+   unsigned long                   cache_misses;
+   unsigned long                   cache_memory;             // Gauge
+};
+
+struct metrics_text_struct {
+   char   *text;
+   size_t  text_length;
+   size_t  text_size;
+   bool    error_status;
+};
+
+// Declarations
+
+static void metrics_histogram_add (struct metrics_histogram_struct *histogram, const unsigned long *bucket_bounds, unsigned long value);
+static void metrics_histogram_sum (struct metrics_histogram_struct *histogram_sum, const struct metrics_histogram_struct *histogram);
+static void metrics_printf (struct metrics_text_struct *metrics_text, const char *format, ...);
+static void metrics_print_histogram (struct metrics_text_struct *metrics_text, const char *name, const char *labels, const struct metrics_histogram_struct *histogram, const unsigned long *bucket_bounds, double unit);
+static void metrics_print_buffer_pools (struct metrics_text_struct *metrics_text);
+
+// Constants
+
+// Microseconds
+static const unsigned long metrics_duration_bounds [METRICS_BUCKET_COUNT] = {
+   1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+// Bytes
+static const unsigned long metrics_size_bounds [METRICS_BUCKET_COUNT] = {
+   256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824
+};
+static const char *metrics_status_classes [METRICS_STATUS_CLASS_COUNT] = {
+   "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+static const unsigned int metrics_error_page_statuses [METRICS_ERROR_PAGE_COUNT] = {
+   MHD_HTTP_BAD_REQUEST,
+   MHD_HTTP_FORBIDDEN,
+   MHD_HTTP_NOT_FOUND,
+   MHD_HTTP_METHOD_NOT_ALLOWED,
+   MHD_HTTP_PAYLOAD_TOO_LARGE,
+   MHD_HTTP_INTERNAL_SERVER_ERROR,
+   MHD_HTTP_SERVICE_UNAVAILABLE,
+   0                               // Others
+};
+
+// Globals variables
+
+static const char *metrics_subr_names [METRICS_SUBR_MAX] = { "" };
+static int metrics_subr_length = 1;
+static struct metrics_worker_struct *metrics_workers = NULL;
+static struct metrics_worker_struct *metrics_worker = NULL;  // Slot of this worker
+
+// Functions
+
+void metrics_histogram_add (struct metrics_histogram_struct *histogram, const unsigned long *bucket_bounds, unsigned long value)
+{
+   int bucket_index = 0;
+
+   while (bucket_index < METRICS_BUCKET_COUNT && value > bucket_bounds [bucket_index]) {
+      ++bucket_index;
+   }
+   if (bucket_index < METRICS_BUCKET_COUNT) {
+      __atomic_fetch_add (&histogram->buckets [bucket_index], 1, __ATOMIC_RELAXED);
+   }
+   __atomic_fetch_add (&histogram->count, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add (&histogram->sum, value, __ATOMIC_RELAXED);
+}
+
+void metrics_histogram_sum (struct metrics_histogram_struct *histogram_sum, const struct metrics_histogram_struct *histogram)
+{
+   for (int bucket_index = 0 ; bucket_index < METRICS_BUCKET_COUNT ; ++bucket_index) {
+      histogram_sum->buckets [bucket_index] += __atomic_load_n (&histogram->buckets [bucket_index], __ATOMIC_RELAXED);
+   }
+   histogram_sum->count += __atomic_load_n (&histogram->count, __ATOMIC_RELAXED);
+   histogram_sum->sum += __atomic_load_n (&histogram->sum, __ATOMIC_RELAXED);
+}
+
+void metrics_printf (struct metrics_text_struct *metrics_text, const char *format, ...)
+{
+   va_list format_args;
+
+   while (!metrics_text->error_status) {
+      size_t text_free = metrics_text->text_size - metrics_text->text_length;
+
+      va_start (format_args, format);
+      int print_length = vsnprintf (metrics_text->text + metrics_text->text_length, text_free, format, format_args);
+      va_end (format_args);
+      if (print_length < 0) {
+         metrics_text->error_status = true;
+      }
+      else if (print_length < text_free) {
+         metrics_text->text_length += print_length;
+         return;
+      }
+      else {
+         char *new_text = realloc (metrics_text->text, metrics_text->text_size * 2 + print_length);
+
+         if (new_text == NULL) {
+            metrics_text->error_status = true;
+         }
+         else {
+            metrics_text->text = new_text;
+            metrics_text->text_size = metrics_text->text_size * 2 + print_length;
+         }
+      }
+   }
+}
+
+void metrics_print_histogram (struct metrics_text_struct *metrics_text, const char *name, const char *labels, const struct metrics_histogram_struct *histogram, const unsigned long *bucket_bounds, double unit)
+{
+   // labels is empty or ends by a comma
+   unsigned long bucket_count = 0;
+
+   for (int bucket_index = 0 ; bucket_index < METRICS_BUCKET_COUNT ; ++bucket_index) {
+      bucket_count += histogram->buckets [bucket_index];
+      metrics_printf (metrics_text, "%s_bucket{%sle=\"%g\"} %lu\n", name, labels, bucket_bounds [bucket_index] / unit, bucket_count);
+   }
+   metrics_printf (metrics_text, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, histogram->count);
+   if (labels [0] == '\0') {
+      metrics_printf (metrics_text, "%s_sum %g\n%s_count %lu\n", name, histogram->sum / unit, name, histogram->count);
+   }
+   else {
+      int label_length = strlen (labels) - 1;
+
+      metrics_printf (metrics_text, "%s_sum{%.*s} %g\n%s_count{%.*s} %lu\n", name, label_length, labels, histogram->sum / unit, name, label_length, labels, histogram->count);
+   }
+}
+
+void metrics_print_buffer_pools (struct metrics_text_struct *metrics_text)
+{
+   // By worker, a sum of the high water marks wouldn't mean anything
+   static const char *buffer_metric_names [] = {
+      "allocated",
+      "in_use",
+      "high_water",
+      "free"
+   };
+   static const char *buffer_metric_helps [] = {
+      "Buffers allocated, in use or free",
+      "Buffers in use",
+      "Maximum of the buffers in use",
+      "Free buffers kept in the pool"
+   };
+
+   for (int metric_index = 0 ; metric_index < sizeof (buffer_metric_names) / sizeof (buffer_metric_names [0]) ; ++metric_index) {
+      metrics_printf (metrics_text, "# HELP ohs_buffer_pool_%s %s.\n# TYPE ohs_buffer_pool_%s gauge\n", buffer_metric_names [metric_index], buffer_metric_helps [metric_index], buffer_metric_names [metric_index]);
+      for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+         for (int pool_id = 0 ; pool_id < bp_count ; ++pool_id) {
+            const struct ohs_buffer_stats_struct *buffer_stats = &metrics_workers [worker_index].buffer_stats [pool_id];
+            const unsigned long *buffer_values [] = {
+               &buffer_stats->allocated,
+               &buffer_stats->in_use,
+               &buffer_stats->high_water,
+               &buffer_stats->free_length
+            };
+
+            metrics_printf (metrics_text, "ohs_buffer_pool_%s{pool=\"%s\",worker=\"%d\"} %lu\n", buffer_metric_names [metric_index], ohs_buffer_pool_name (pool_id), worker_index, __atomic_load_n (buffer_values [metric_index], __ATOMIC_RELAXED));
+         }
+      }
+   }
+   metrics_printf (metrics_text, "# HELP ohs_buffer_pool_buffer_bytes Size of the buffers of the pool.\n# TYPE ohs_buffer_pool_buffer_bytes gauge\n");
+   for (int pool_id = 0 ; pool_id < bp_count ; ++pool_id) {
+      metrics_printf (metrics_text, "ohs_buffer_pool_buffer_bytes{pool=\"%s\"} %zu\n", ohs_buffer_pool_name (pool_id), ohs_buffer_size (pool_id));
+   }
+}
+
+int ohs_metrics_subr_index (const char *subr)
+{
+   // Called when the routes are compiled, the last index is shared by the
+   // subroutines beyond METRICS_SUBR_MAX
+   if (subr == NULL) {
+      return 0;
+   }
+   for (int subr_index = 1 ; subr_index < metrics_subr_length ; ++subr_index) {
+      if (strcmp (metrics_subr_names [subr_index], subr) == 0) {
+         return subr_index;
+      }
+   }
+   if (metrics_subr_length == METRICS_SUBR_MAX) {
+      return METRICS_SUBR_MAX - 1;
+   }
+   metrics_subr_names [metrics_subr_length] = subr;
+   return metrics_subr_length++;
+}
+
+bool ohs_metrics_init ()
+{
+   // Before the workers are forked, one slot by worker
+   if (config_http_metrics_path == NULL) {
+      return true;
+   }
+   metrics_workers = mmap (NULL, config_http_workers * sizeof (struct metrics_worker_struct), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (metrics_workers == MAP_FAILED) {
+      metrics_workers = NULL;
+      abort_message ("Can't create shared metrics");
+      return false;
+   }
+   return true;
+}
+
+void ohs_metrics_worker (int worker_index)
+{
+   if (metrics_workers != NULL) {
+      metrics_worker = &metrics_workers [worker_index];
+      // Gauges of the previous process of this worker
+      memset (metrics_worker->buffer_stats, 0, sizeof (metrics_worker->buffer_stats));
+      metrics_worker->cache_memory = 0;
+   }
+}
+
+unsigned long ohs_metrics_clock ()
+{
+   // Monotonic microseconds
+   struct timespec clock_time;
+
+   clock_gettime (CLOCK_MONOTONIC, &clock_time);
+   return clock_time.tv_sec * 1000000ul + clock_time.tv_nsec / 1000;
+}
+
+void ohs_metrics_request (int subr_index, unsigned int http_status, unsigned long duration, size_t request_body_size)
+{
+   if (metrics_worker == NULL) {
+      return;
+   }
+
+   int status_class = http_status >= 100 && http_status < 600 ? http_status / 100 : 0;
+
+   __atomic_fetch_add (&metrics_worker->requests [subr_index][status_class], 1, __ATOMIC_RELAXED);
+   metrics_histogram_add (&metrics_worker->request_duration [subr_index], metrics_duration_bounds, duration);
+   if (request_body_size > 0) {
+      metrics_histogram_add (&metrics_worker->request_body_size, metrics_size_bounds, request_body_size);
+   }
+}
+
+void ohs_metrics_response_body (size_t response_body_size)
+{
+   if (metrics_worker != NULL) {
+      metrics_histogram_add (&metrics_worker->response_body_size, metrics_size_bounds, response_body_size);
+   }
+}
+
+void ohs_metrics_qmcall (unsigned long duration)
+{
+   if (metrics_worker != NULL) {
+      metrics_histogram_add (&metrics_worker->qmcall_duration, metrics_duration_bounds, duration);
+   }
+}
+
+void ohs_metrics_qm_connect (unsigned long duration)
+{
+   if (metrics_worker != NULL) {
+      metrics_histogram_add (&metrics_worker->qm_connect_duration, metrics_duration_bounds, duration);
+   }
+}
+
+void ohs_metrics_error_page (unsigned int http_status)
+{
+   if (metrics_worker == NULL) {
+      return;
+   }
+
+   int error_page_index = 0;
+
+   while (error_page_index < METRICS_ERROR_PAGE_COUNT - 1 && metrics_error_page_statuses [error_page_index] != http_status) {
+      ++error_page_index;
+   }
+   __atomic_fetch_add (&metrics_worker->error_pages [error_page_index], 1, __ATOMIC_RELAXED);
+}
+
+void ohs_metrics_buffer (enum buffer_pool_enum pool_id, const struct ohs_buffer_stats_struct *buffer_stats)
+{
+   // Called by the pool under its lock after each change
+   if (metrics_worker == NULL) {
+      return;
+   }
+
+   struct ohs_buffer_stats_struct *buffer_stats_slot = &metrics_worker->buffer_stats [pool_id];
+
+   __atomic_store_n (&buffer_stats_slot->allocated, buffer_stats->allocated, __ATOMIC_RELAXED);
+   __atomic_store_n (&buffer_stats_slot->in_use, buffer_stats->in_use, __ATOMIC_RELAXED);
+   __atomic_store_n (&buffer_stats_slot->high_water, buffer_stats->high_water, __ATOMIC_RELAXED);
+   __atomic_store_n (&buffer_stats_slot->free_length, buffer_stats->free_length, __ATOMIC_RELAXED);
+}
+
+void ohs_metrics_cache_lookup (bool cache_hit)
+{
+   if (metrics_worker != NULL) {
+      __atomic_fetch_add (cache_hit ? &metrics_worker->cache_hits : &metrics_worker->cache_misses, 1, __ATOMIC_RELAXED);
+   }
+}
+
+void ohs_metrics_cache_memory (size_t cache_memory)
+{
+   if (metrics_worker != NULL) {
+      __atomic_store_n (&metrics_worker->cache_memory, cache_memory, __ATOMIC_RELAXED);
+   }
+}
+
+int ohs_metrics_handle (struct connection_info_struct *connection_info)
+{
+   struct MHD_Connection *connection = connection_info->connection;
+   struct MHD_Response *response;
+   int return_status;
+
+   if (!ohs_admin_client_trusted (connection, config_http_metrics_token)) {
+      abort_message ("Metrics refused to an unauthenticated client");
+      return ohs_admin_send_text (connection_info, MHD_HTTP_FORBIDDEN, "Forbidden\n");
+   }
+
+   // Sum of all the workers, the snapshot isn't atomic
+   struct metrics_worker_struct *metrics_sum = calloc (1, sizeof (struct metrics_worker_struct));
+   struct metrics_text_struct metrics_text = { malloc (16384), 0, 16384, false };
+
+   if (metrics_sum == NULL || metrics_text.text == NULL) {
+      free (metrics_sum);
+      free (metrics_text.text);
+      return MHD_NO;
+   }
+   for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+      struct metrics_worker_struct *metrics_worker_slot = &metrics_workers [worker_index];
+
+      for (int subr_index = 0 ; subr_index < metrics_subr_length ; ++subr_index) {
+         for (int status_class = 0 ; status_class < METRICS_STATUS_CLASS_COUNT ; ++status_class) {
+            metrics_sum->requests [subr_index][status_class] += __atomic_load_n (&metrics_worker_slot->requests [subr_index][status_class], __ATOMIC_RELAXED);
+         }
+         metrics_histogram_sum (&metrics_sum->request_duration [subr_index], &metrics_worker_slot->request_duration [subr_index]);
+      }
+      metrics_histogram_sum (&metrics_sum->qmcall_duration, &metrics_worker_slot->qmcall_duration);
+      metrics_histogram_sum (&metrics_sum->qm_connect_duration, &metrics_worker_slot->qm_connect_duration);
+      metrics_histogram_sum (&metrics_sum->request_body_size, &metrics_worker_slot->request_body_size);
+      metrics_histogram_sum (&metrics_sum->response_body_size, &metrics_worker_slot->response_body_size);
+      for (int error_page_index = 0 ; error_page_index < METRICS_ERROR_PAGE_COUNT ; ++error_page_index) {
+         metrics_sum->error_pages [error_page_index] += __atomic_load_n (&metrics_worker_slot->error_pages [error_page_index], __ATOMIC_RELAXED);
+      }
+      metrics_sum->cache_hits += __atomic_load_n (&metrics_worker_slot->cache_hits, __ATOMIC_RELAXED);
+      metrics_sum->cache_misses += __atomic_load_n (&metrics_worker_slot->cache_misses, __ATOMIC_RELAXED);
+      metrics_sum->cache_memory += __atomic_load_n (&metrics_worker_slot->cache_memory, __ATOMIC_RELAXED);
+   }
+
+   metrics_printf (&metrics_text, "# HELP ohs_requests_total Requests by subroutine and status class.\n# TYPE ohs_requests_total counter\n");
+   for (int subr_index = 0 ; subr_index < metrics_subr_length ; ++subr_index) {
+      for (int status_class = 0 ; status_class < METRICS_STATUS_CLASS_COUNT ; ++status_class) {
+         if (metrics_sum->requests [subr_index][status_class] != 0) {
+            metrics_printf (&metrics_text, "ohs_requests_total{subr=\"%s\",code=\"%s\"} %lu\n", metrics_subr_names [subr_index], metrics_status_classes [status_class], metrics_sum->requests [subr_index][status_class]);
+         }
+      }
+   }
+   metrics_printf (&metrics_text, "# HELP ohs_request_duration_seconds Time from the request headers to the end of the response.\n# TYPE ohs_request_duration_seconds histogram\n");
+   for (int subr_index = 0 ; subr_index < metrics_subr_length ; ++subr_index) {
+      if (metrics_sum->request_duration [subr_index].count != 0) {
+         char subr_label [256];
+
+         snprintf (subr_label, sizeof (subr_label), "subr=\"%s\",", metrics_subr_names [subr_index]);
+         metrics_print_histogram (&metrics_text, "ohs_request_duration_seconds", subr_label, &metrics_sum->request_duration [subr_index], metrics_duration_bounds, 1e6);
+      }
+   }
+   metrics_printf (&metrics_text, "# HELP ohs_qmcall_duration_seconds Duration of QMCall.\n# TYPE ohs_qmcall_duration_seconds histogram\n");
+   metrics_print_histogram (&metrics_text, "ohs_qmcall_duration_seconds", "", &metrics_sum->qmcall_duration, metrics_duration_bounds, 1e6);
+   metrics_printf (&metrics_text, "# HELP ohs_qm_connect_duration_seconds Duration of the connections to OpenQM.\n# TYPE ohs_qm_connect_duration_seconds histogram\n");
+   metrics_print_histogram (&metrics_text, "ohs_qm_connect_duration_seconds", "", &metrics_sum->qm_connect_duration, metrics_duration_bounds, 1e6);
+   metrics_printf (&metrics_text, "# HELP ohs_request_body_bytes Size of the request bodies.\n# TYPE ohs_request_body_bytes histogram\n");
+   metrics_print_histogram (&metrics_text, "ohs_request_body_bytes", "", &metrics_sum->request_body_size, metrics_size_bounds, 1);
+   metrics_printf (&metrics_text, "# HELP ohs_response_body_bytes Size of the response bodies sent from http_output.\n# TYPE ohs_response_body_bytes histogram\n");
+   metrics_print_histogram (&metrics_text, "ohs_response_body_bytes", "", &metrics_sum->response_body_size, metrics_size_bounds, 1);
+   metrics_printf (&metrics_text, "# HELP ohs_error_pages_total Error pages generated by the server.\n# TYPE ohs_error_pages_total counter\n");
+   for (int error_page_index = 0 ; error_page_index < METRICS_ERROR_PAGE_COUNT ; ++error_page_index) {
+      if (metrics_error_page_statuses [error_page_index] == 0) {
+         metrics_printf (&metrics_text, "ohs_error_pages_total{code=\"other\"} %lu\n", metrics_sum->error_pages [error_page_index]);
+      }
+      else {
+         metrics_printf (&metrics_text, "ohs_error_pages_total{code=\"%u\"} %lu\n", metrics_error_page_statuses [error_page_index], metrics_sum->error_pages [error_page_index]);
+      }
+   }
+   metrics_printf (&metrics_text, "# HELP ohs_cache_hits_total Requests answered by the response cache.\n# TYPE ohs_cache_hits_total counter\nohs_cache_hits_total %lu\n", metrics_sum->cache_hits);
+   metrics_printf (&metrics_text, "# HELP ohs_cache_misses_total Requests not found in the response cache.\n# TYPE ohs_cache_misses_total counter\nohs_cache_misses_total %lu\n", metrics_sum->cache_misses);
+   metrics_printf (&metrics_text, "# HELP ohs_cache_memory_bytes Memory used by the response caches.\n# TYPE ohs_cache_memory_bytes gauge\nohs_cache_memory_bytes %lu\n", metrics_sum->cache_memory);
+   metrics_print_buffer_pools (&metrics_text);
+   free (metrics_sum);
+   if (metrics_text.error_status) {
+      free (metrics_text.text);
+      abort_message ("Full memory when generating metrics");
+      return MHD_NO;
+   }
+
+   response = MHD_create_response_from_buffer (metrics_text.text_length, metrics_text.text, MHD_RESPMEM_MUST_FREE);
+   if (response == NULL) {
+      free (metrics_text.text);
+      return MHD_NO;
+   }
+   MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4; charset=utf-8");
+   MHD_add_response_header (response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store");
+   connection_info->http_status = MHD_HTTP_OK;
+   connection_info->response_body_length = metrics_text.text_length;
+   return_status = MHD_queue_response (connection, MHD_HTTP_OK, response);
+   MHD_destroy_response (response);
+   return return_status;
+}
@@ -0,0 +1,130 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include <qmdefs.h>
+#include <qmclilib.h>
+
+#include "openqm_httpd_server.h"
+
+// OpenQM session kept connected between requests.
+// The QM client library keeps a "current session" for the whole process and
+// isn't thread safe, so the routines are called one at a time from one thread
+// and a second session would never be used. The session is selected before
+// each call and reconnected when its OpenQM process is gone.
+
+// Types
+
+struct openqm_session_struct {
+   int  session_number; // Session index from QMGetSession
+   bool connected;
+   bool in_use;
+};
+
+// Declarations
+
+static bool pool_session_connect (struct openqm_session_struct *openqm_session);
+static bool pool_session_check (struct openqm_session_struct *openqm_session);
+static void pool_session_drop (struct openqm_session_struct *openqm_session);
+
+// Globals variables
+
+static struct openqm_session_struct openqm_session_worker;
+
+// Functions
+
+bool pool_session_connect (struct openqm_session_struct *openqm_session)
+{
+   unsigned long connect_start_time = ohs_metrics_clock ();
+   bool connect_status = QMConnectLocal (config_openqm_account);
+
+   ohs_metrics_qm_connect (ohs_metrics_clock () - connect_start_time);
+   if (!connect_status) {
+      char error_message_detail [256];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't connect to OpenQM account %s: %s", config_openqm_account, QMError ());
+      abort_message (error_message_detail);
+      openqm_session->connected = false;
+      return false;
+   }
+   openqm_session->session_number = QMGetSession ();
+   openqm_session->connected = true;
+   ohs_log_debug ("Pool session %d connected to OpenQM", openqm_session->session_number);
+   return true;
+}
+
+bool pool_session_check (struct openqm_session_struct *openqm_session)
+{
+   // Select the session and reconnect it if the OpenQM process is gone
+   if (openqm_session->connected) {
+      if (QMSetSession (openqm_session->session_number) && QMConnected ()) {
+         return true;
+      }
+      char error_message_detail [128];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "OpenQM session %d lost, reconnecting", openqm_session->session_number);
+      abort_message (error_message_detail);
+      pool_session_drop (openqm_session);
+   }
+   return pool_session_connect (openqm_session);
+}
+
+void pool_session_drop (struct openqm_session_struct *openqm_session)
+{
+   // The slot of the lost session is freed in the client library, otherwise
+   // each reconnection would leave one more stale session behind
+   if (QMSetSession (openqm_session->session_number)) {
+      QMDisconnect ();
+   }
+   openqm_session->connected = false;
+}
+
+void ohs_pool_init ()
+{
+   // A failed connection is retried when a request needs the session
+   openqm_session_worker.connected = false;
+   openqm_session_worker.in_use = false;
+   pool_session_connect (&openqm_session_worker);
+}
+
+int ohs_pool_acquire ()
+{
+   if (openqm_session_worker.in_use) {
+      abort_message ("OpenQM session of the worker already in use");
+      return -1;
+   }
+   if (!pool_session_check (&openqm_session_worker)) {
+      return -1;
+   }
+   openqm_session_worker.in_use = true;
+   return 0;
+}
+
+void ohs_pool_release (int pool_index)
+{
+   if (pool_index != 0) {
+      return;
+   }
+
+   // Health check after use, a dead session is reconnected on next acquire
+   if (openqm_session_worker.connected && !(QMSetSession (openqm_session_worker.session_number) && QMConnected ())) {
+      char error_message_detail [128];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "OpenQM session %d died during call", openqm_session_worker.session_number);
+      abort_message (error_message_detail);
+      pool_session_drop (&openqm_session_worker);
+   }
+   openqm_session_worker.in_use = false;
+}
+
+void ohs_pool_free ()
+{
+   if (openqm_session_worker.connected && QMSetSession (openqm_session_worker.session_number)) {
+      QMDisconnect ();
+   }
+   openqm_session_worker.connected = false;
+}
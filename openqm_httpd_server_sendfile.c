@@ -0,0 +1,85 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libconfig.h>
+#include <limits.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "openqm_httpd_server.h"
+
+// Responses sent from a file.
+// The routine gives in the X-OHS-Sendfile header out the name of a file of
+// httpd.sendfile_dir. MHD sends the file from its descriptor (with sendfile
+// when it's possible) so the content is never read by the server.
+
+// Functions
+
+struct MHD_Response *ohs_sendfile_create_response (const char *file_name, bool delete_file, size_t *body_length)
+{
+   char error_message_detail [PATH_MAX + 128];
+
+   if (config_http_sendfile_dir == NULL) {
+      abort_message ("X-OHS-Sendfile returned but httpd.sendfile_dir isn't configured");
+      return NULL;
+   }
+
+   // Relative names are in the sendfile directory, the real name must stay
+   // in it whatever the links and the ".." of the name
+   char full_name [PATH_MAX];
+   char real_name [PATH_MAX];
+   size_t dir_length = strlen (config_http_sendfile_dir);
+
+   if (file_name [0] == '/') {
+      snprintf (full_name, sizeof (full_name), "%s", file_name);
+   }
+   else {
+      snprintf (full_name, sizeof (full_name), "%s/%s", config_http_sendfile_dir, file_name);
+   }
+   if (realpath (full_name, real_name) == NULL) {
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't find file to send %s: %m", full_name);
+      abort_message (error_message_detail);
+      return NULL;
+   }
+   if (strncmp (real_name, config_http_sendfile_dir, dir_length) != 0 || real_name [dir_length] != '/') {
+      snprintf (error_message_detail, sizeof (error_message_detail), "File to send %s isn't in %s", real_name, config_http_sendfile_dir);
+      abort_message (error_message_detail);
+      return NULL;
+   }
+
+   int file_fd = open (real_name, O_RDONLY | O_CLOEXEC);
+   struct stat file_stat;
+
+   if (file_fd < 0) {
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't open file to send %s: %m", real_name);
+      abort_message (error_message_detail);
+      return NULL;
+   }
+   if (fstat (file_fd, &file_stat) != 0 || !S_ISREG (file_stat.st_mode)) {
+      snprintf (error_message_detail, sizeof (error_message_detail), "File to send %s isn't a regular file", real_name);
+      abort_message (error_message_detail);
+      close (file_fd);
+      return NULL;
+   }
+   // The content stays readable from the descriptor until MHD closes it
+   if (delete_file && unlink (real_name) != 0) {
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't delete sent file %s: %m", real_name);
+      abort_message (error_message_detail);
+   }
+
+   struct MHD_Response *response = MHD_create_response_from_fd64 (file_stat.st_size, file_fd);
+
+   if (response == NULL) {
+      abort_message ("Can't create response from file");
+      close (file_fd);
+   }
+   else {
+      *body_length = file_stat.st_size;
+   }
+   return response;
+}
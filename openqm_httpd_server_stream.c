@@ -0,0 +1,254 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qmdefs.h>
+#include <qmclilib.h>
+
+#include "openqm_httpd_server.h"
+
+// Responses larger than the http_output buffer.
+// The routine returns the first part of the page in http_output and a handle
+// in the X-OHS-Continue header out. The following parts are fetched by calling
+// openqm.continue_subr (HANDLE, HTTP.OUTPUT) until it returns an empty
+// HTTP.OUTPUT. Each part is sent as soon as it is received, the next part is
+// fetched by the executor while the current one is sent, so the whole page is
+// never held in memory.
+
+// Types
+
+struct stream_chunk_struct {
+   char   *data;   // Buffer of the http_output pool
+   size_t  length;
+   bool    ready;
+};
+
+struct ohs_stream_struct {
+   struct MHD_Connection      *connection;
+   pthread_mutex_t             stream_mutex;
+   struct stream_chunk_struct  chunks [2];
+   int                         send_index;     // Chunk being sent, the other one is fetched
+   size_t                      send_position;
+   bool                        fetching;       // A fetch job is queued or running
+   bool                        waiting;        // Connection suspended until the fetch is done
+   bool                        end_of_stream;
+   bool                        failed;
+   bool                        response_freed;
+   struct ohs_job_struct       fetch_job;
+   char                        handle [];
+};
+
+// Declarations
+
+static bool stream_start_fetch (struct ohs_stream_struct *stream);
+static void stream_fetch_job (void *stream_cls);
+static ssize_t stream_reader (void *stream_cls, uint64_t position, char *buffer, size_t buffer_size);
+static void stream_free (void *stream_cls);
+static void stream_destroy (struct ohs_stream_struct *stream);
+
+// Constants
+
+static const size_t stream_block_size = 32768;
+
+// Functions
+
+void stream_destroy (struct ohs_stream_struct *stream)
+{
+   for (int chunk_index = 0 ; chunk_index < 2 ; ++chunk_index) {
+      if (stream->chunks [chunk_index].data != NULL) {
+         ohs_buffer_release (bp_http_output, stream->chunks [chunk_index].data);
+      }
+   }
+   pthread_mutex_destroy (&stream->stream_mutex);
+   free (stream);
+}
+
+bool stream_start_fetch (struct ohs_stream_struct *stream)
+{
+   // Called with the stream locked, fetch in the chunk not being sent
+   struct stream_chunk_struct *chunk = &stream->chunks [1 - stream->send_index];
+
+   if (stream->fetching || stream->end_of_stream || stream->failed || chunk->ready) {
+      return true;
+   }
+   if (chunk->data == NULL) {
+      chunk->data = ohs_buffer_acquire (bp_http_output);
+      if (chunk->data == NULL) {
+         abort_message ("Full memory when fetching next part of the output");
+         stream->failed = true;
+         return false;
+      }
+   }
+   sprintf (chunk->data, "*%zu", ohs_buffer_size (bp_http_output) - 1);
+   stream->fetching = true;
+   if (!ohs_executor_submit (&stream->fetch_job, NULL)) {
+      stream->fetching = false;
+      stream->failed = true;
+      return false;
+   }
+   return true;
+}
+
+void stream_fetch_job (void *stream_cls)
+{
+   // Executed by the executor thread, the chunk isn't used by the MHD thread
+   // while fetching is set
+   struct ohs_stream_struct *stream = stream_cls;
+   struct stream_chunk_struct *chunk;
+   bool call_failed = false;
+
+   pthread_mutex_lock (&stream->stream_mutex);
+   chunk = &stream->chunks [1 - stream->send_index];
+   bool response_freed = stream->response_freed;
+   pthread_mutex_unlock (&stream->stream_mutex);
+
+   // Nothing to fetch when the client is gone
+   if (!response_freed) {
+      int pool_index = ohs_pool_acquire ();
+
+      if (pool_index < 0) {
+         call_failed = true;
+      }
+      else {
+         QMCall (config_openqm_continue_subr, 2, stream->handle, chunk->data);
+         ohs_pool_release (pool_index);
+      }
+   }
+
+   pthread_mutex_lock (&stream->stream_mutex);
+   stream->fetching = false;
+   if (call_failed) {
+      stream->failed = true;
+   }
+   else {
+      chunk->length = strlen (chunk->data);
+      chunk->ready = true;
+   }
+   if (stream->waiting) {
+      stream->waiting = false;
+      MHD_resume_connection (stream->connection);
+   }
+   response_freed = stream->response_freed;
+   pthread_mutex_unlock (&stream->stream_mutex);
+   if (response_freed) {
+      stream_destroy (stream);
+   }
+}
+
+ssize_t stream_reader (void *stream_cls, uint64_t position, char *buffer, size_t buffer_size)
+{
+   struct ohs_stream_struct *stream = stream_cls;
+   ssize_t read_length;
+
+   pthread_mutex_lock (&stream->stream_mutex);
+   for (;;) {
+      struct stream_chunk_struct *chunk = &stream->chunks [stream->send_index];
+
+      if (chunk->ready && stream->send_position < chunk->length) {
+         size_t copy_length = chunk->length - stream->send_position;
+
+         if (copy_length > buffer_size) {
+            copy_length = buffer_size;
+         }
+         memcpy (buffer, chunk->data + stream->send_position, copy_length);
+         stream->send_position += copy_length;
+         read_length = copy_length;
+         // Prefetch the next part while this one is sent
+         stream_start_fetch (stream);
+         break;
+      }
+
+      struct stream_chunk_struct *next_chunk = &stream->chunks [1 - stream->send_index];
+
+      if (chunk->ready && next_chunk->ready) {
+         // An empty part ends the page
+         if (next_chunk->length == 0) {
+            stream->end_of_stream = true;
+            read_length = MHD_CONTENT_READER_END_OF_STREAM;
+            break;
+         }
+         chunk->ready = false;
+         stream->send_index = 1 - stream->send_index;
+         stream->send_position = 0;
+         continue;
+      }
+      if (stream->failed) {
+         read_length = MHD_CONTENT_READER_END_WITH_ERROR;
+         break;
+      }
+      if (!stream_start_fetch (stream)) {
+         read_length = MHD_CONTENT_READER_END_WITH_ERROR;
+         break;
+      }
+      // Wait for the executor, it resumes the connection
+      stream->waiting = true;
+      MHD_suspend_connection (stream->connection);
+      read_length = 0;
+      break;
+   }
+   pthread_mutex_unlock (&stream->stream_mutex);
+   return read_length;
+}
+
+void stream_free (void *stream_cls)
+{
+   // MHD free callback, the stream is destroyed by the fetch job if it's running
+   struct ohs_stream_struct *stream = stream_cls;
+
+   pthread_mutex_lock (&stream->stream_mutex);
+   stream->response_freed = true;
+   bool fetching = stream->fetching;
+   pthread_mutex_unlock (&stream->stream_mutex);
+   if (!fetching) {
+      stream_destroy (stream);
+   }
+}
+
+struct MHD_Response *ohs_stream_create_response (struct MHD_Connection *connection, const char *handle, char *http_output)
+{
+   // Take the http_output buffer as first part when the response is created
+   size_t handle_length = strlen (handle);
+   struct ohs_stream_struct *stream = malloc (sizeof (struct ohs_stream_struct) + handle_length + 1);
+
+   if (stream == NULL) {
+      abort_message ("Full memory when creating output stream");
+      return NULL;
+   }
+   stream->connection = connection;
+   pthread_mutex_init (&stream->stream_mutex, NULL);
+   stream->chunks [0].data = http_output;
+   stream->chunks [0].length = strlen (http_output);
+   stream->chunks [0].ready = true;
+   stream->chunks [1].data = NULL;
+   stream->chunks [1].length = 0;
+   stream->chunks [1].ready = false;
+   stream->send_index = 0;
+   stream->send_position = 0;
+   stream->fetching = false;
+   stream->waiting = false;
+   stream->end_of_stream = false;
+   stream->failed = false;
+   stream->response_freed = false;
+   stream->fetch_job.job_function = &stream_fetch_job;
+   stream->fetch_job.job_cls = stream;
+   stream->fetch_job.next = NULL;
+   memcpy (stream->handle, handle, handle_length + 1);
+
+   struct MHD_Response *response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN, stream_block_size, &stream_reader, stream, &stream_free);
+
+   if (response == NULL) {
+      stream->chunks [0].data = NULL;
+      stream_destroy (stream);
+      return NULL;
+   }
+   // The second part is fetched while the headers and the first part are sent
+   pthread_mutex_lock (&stream->stream_mutex);
+   stream_start_fetch (stream);
+   pthread_mutex_unlock (&stream->stream_mutex);
+   return response;
+}
@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <qmdefs.h>
+
+#include "openqm_httpd_server.h"
+
+// Files received by POST.
+// The file parts of a multipart/form-data body are written to temporary files
+// of httpd.upload_dir as they are received, so the memory used doesn't depend
+// on the size of the files. The routine receives for each file its path, its
+// size and its content type, the files are deleted when the request is
+// completed.
+
+// Types
+
+struct upload_file_struct {
+   const char                *key;
+   char                      *path;
+   const char                *content_type;
+   int                        file_fd;
+   unsigned long long         size;
+   struct upload_file_struct *next;
+};
+
+// Constants
+
+static const char upload_file_template [] = "/ohs_upload_XXXXXX";
+
+// Functions
+
+bool ohs_upload_write (struct post_info_struct *post_info, const char *key, const char *content_type, const char *data, uint64_t off, size_t size)
+{
+   struct ohs_arena_struct *arena = post_info->post_builder.arena;
+   struct upload_file_struct *upload_file = post_info->last_upload;
+
+   // A new file starts at offset 0, the following parts are appended
+   if (off == 0 || upload_file == NULL || strcmp (upload_file->key, key) != 0) {
+      upload_file = ohs_arena_alloc (arena, sizeof (struct upload_file_struct));
+      if (upload_file == NULL) {
+         abort_message ("Full memory when receiving file");
+         return false;
+      }
+      upload_file->key = ohs_arena_strdup (arena, key);
+      upload_file->content_type = ohs_arena_strdup (arena, content_type == NULL ? "" : content_type);
+      upload_file->path = ohs_arena_alloc (arena, strlen (config_http_upload_dir) + sizeof (upload_file_template));
+      if (upload_file->key == NULL || upload_file->content_type == NULL || upload_file->path == NULL) {
+         abort_message ("Full memory when receiving file");
+         return false;
+      }
+      sprintf (upload_file->path, "%s%s", config_http_upload_dir, upload_file_template);
+      upload_file->file_fd = mkstemp (upload_file->path);
+      if (upload_file->file_fd < 0) {
+         char error_message_detail [256];
+
+         snprintf (error_message_detail, sizeof (error_message_detail), "Can't create upload file in %s: %m", config_http_upload_dir);
+         abort_message (error_message_detail);
+         return false;
+      }
+      upload_file->size = 0;
+      upload_file->next = NULL;
+      if (post_info->last_upload == NULL) {
+         post_info->first_upload = upload_file;
+      }
+      else {
+         post_info->last_upload->next = upload_file;
+      }
+      post_info->last_upload = upload_file;
+   }
+
+   while (size) {
+      ssize_t write_length = write (upload_file->file_fd, data, size);
+
+      if (write_length < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         char error_message_detail [256];
+
+         snprintf (error_message_detail, sizeof (error_message_detail), "Can't write upload file %s: %m", upload_file->path);
+         abort_message (error_message_detail);
+         return false;
+      }
+      data += write_length;
+      size -= write_length;
+      upload_file->size += write_length;
+   }
+   return true;
+}
+
+bool ohs_upload_finish (struct post_info_struct *post_info)
+{
+   // Each file is passed as path, size and content type in sub-values. Several
+   // files of the same field follow each other in the same value.
+   for (struct upload_file_struct *upload_file = post_info->first_upload ; upload_file != NULL ; upload_file = upload_file->next) {
+      char upload_value [strlen (upload_file->path) + strlen (upload_file->content_type) + 32];
+      bool key_already_added = false;
+
+      close (upload_file->file_fd);
+      upload_file->file_fd = -1;
+      for (struct upload_file_struct *previous_file = post_info->first_upload ; previous_file != upload_file ; previous_file = previous_file->next) {
+         if (strcmp (previous_file->key, upload_file->key) == 0) {
+            key_already_added = true;
+            break;
+         }
+      }
+      snprintf (upload_value, sizeof (upload_value), "%s%s" SUBVALUE_MARK_STRING "%llu" SUBVALUE_MARK_STRING "%s", key_already_added ? SUBVALUE_MARK_STRING : "", upload_file->path, upload_file->size, upload_file->content_type);
+      if (!dynarray_builder_add (&post_info->post_builder, upload_file->key, upload_value, strlen (upload_value))) {
+         abort_message ("Full memory when receiving file");
+         return false;
+      }
+   }
+   return true;
+}
+
+void ohs_upload_cleanup (struct post_info_struct *post_info)
+{
+   // The routine has moved or copied the files it keeps
+   for (struct upload_file_struct *upload_file = post_info->first_upload ; upload_file != NULL ; upload_file = upload_file->next) {
+      if (upload_file->file_fd >= 0) {
+         close (upload_file->file_fd);
+      }
+      if (unlink (upload_file->path) != 0 && errno != ENOENT) {
+         char error_message_detail [256];
+
+         snprintf (error_message_detail, sizeof (error_message_detail), "Can't delete upload file %s: %m", upload_file->path);
+         abort_message (error_message_detail);
+      }
+   }
+   post_info->first_upload = NULL;
+   post_info->last_upload = NULL;
+}
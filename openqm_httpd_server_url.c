@@ -1,16 +1,306 @@
 #include <pcre.h>
+#include <ctype.h>
 #include <libconfig.h>
 #include <microhttpd.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <syslog.h>
 
 #include "openqm_httpd_server.h"
 
-int check_folder_pattern (const char* folder_name, size_t folder_length, pcre *pattern_comp)
+// Sizes
+
+#define METHOD_NAME_COUNT 9
+
+// Types
+
+struct method_name_struct {
+   const char   *name;
+   unsigned int  bit;
+};
+
+// Declarations
+
+static unsigned int hash_nocase (const char *string, size_t string_length);
+static unsigned int hash_table_size (int element_count);
+static struct string_set_struct *string_set_create (int string_length, const char **strings);
+static bool string_set_contains (const struct string_set_struct *string_set, const char *string);
+static void route_node_free (struct route_node_struct *route_node);
+static unsigned int route_method_mask (int method_length, const char **method);
+static struct route_node_struct *route_node_compile (struct url_config_struct *first_config, struct url_config_struct *owner_config, const struct route_node_struct *parent_node);
+static const struct route_node_struct *route_node_find (const struct route_node_struct *route_node, const char *folder_name, size_t folder_length);
+
+// Constants
+
+// Methods of RFC 9110 and PATCH
+static const struct method_name_struct method_names [METHOD_NAME_COUNT] = {
+   { "GET",     OHS_METHOD_GET },
+   { "HEAD",    OHS_METHOD_HEAD },
+   { "POST",    OHS_METHOD_POST },
+   { "PUT",     OHS_METHOD_PUT },
+   { "PATCH",   OHS_METHOD_PATCH },
+   { "DELETE",  OHS_METHOD_DELETE },
+   { "OPTIONS", OHS_METHOD_OPTIONS },
+   { "CONNECT", OHS_METHOD_CONNECT },
+   { "TRACE",   OHS_METHOD_TRACE }
+};
+
+// Globals variables
+
+static struct route_node_struct *route_root = NULL;
+
+// Functions
+
+unsigned int hash_nocase (const char *string, size_t string_length)
+{
+   // FNV-1a, the url path are compared without case
+   unsigned int hash = 2166136261u;
+
+   for (size_t char_index = 0 ; char_index < string_length ; ++char_index) {
+      hash ^= (unsigned char) tolower ((unsigned char) string [char_index]);
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+unsigned int hash_table_size (int element_count)
+{
+   // Power of 2 with at most 50% load
+   unsigned int table_size = 2;
+
+   while (table_size < (unsigned int) element_count * 2) {
+      table_size <<= 1;
+   }
+   return table_size;
+}
+
+struct string_set_struct *string_set_create (int string_length, const char **strings)
 {
-   int prce_status = pcre_exec (pattern_comp, NULL, folder_name, folder_length, 0, 0, NULL, 0);
+   struct string_set_struct *string_set = malloc (sizeof (struct string_set_struct));
+
+   if (string_set == NULL) {
+      return NULL;
+   }
+
+   unsigned int table_size = hash_table_size (string_length);
+
+   string_set->bucket_mask = table_size - 1;
+   string_set->buckets = calloc (table_size, sizeof (const char *));
+   if (string_set->buckets == NULL) {
+      free (string_set);
+      return NULL;
+   }
+   for (int string_index = 0 ; string_index < string_length ; ++string_index) {
+      if (strings [string_index] != NULL) {
+         unsigned int bucket = hash_nocase (strings [string_index], strlen (strings [string_index])) & string_set->bucket_mask;
+
+         while (string_set->buckets [bucket] != NULL && strcasecmp (string_set->buckets [bucket], strings [string_index]) != 0) {
+            bucket = (bucket + 1) & string_set->bucket_mask;
+         }
+         string_set->buckets [bucket] = strings [string_index];
+      }
+   }
+   return string_set;
+}
+
+bool string_set_contains (const struct string_set_struct *string_set, const char *string)
+{
+   unsigned int bucket = hash_nocase (string, strlen (string)) & string_set->bucket_mask;
+
+   while (string_set->buckets [bucket] != NULL) {
+      if (strcasecmp (string_set->buckets [bucket], string) == 0) {
+         return true;
+      }
+      bucket = (bucket + 1) & string_set->bucket_mask;
+   }
+   return false;
+}
+
+void route_node_free (struct route_node_struct *route_node)
+{
+   if (route_node->literals != NULL) {
+      for (unsigned int bucket = 0 ; bucket <= route_node->literal_mask ; ++bucket) {
+         if (route_node->literals [bucket].node != NULL) {
+            route_node_free (route_node->literals [bucket].node);
+         }
+      }
+      free (route_node->literals);
+   }
+   if (route_node->patterns != NULL) {
+      for (int pattern_index = 0 ; pattern_index < route_node->pattern_length ; ++pattern_index) {
+         route_node_free (route_node->patterns [pattern_index].node);
+      }
+      free (route_node->patterns);
+   }
+   if (route_node->get_param_set != NULL) {
+      free (route_node->get_param_set->buckets);
+      free (route_node->get_param_set);
+   }
+   free (route_node);
+}
+
+unsigned int route_method_mask (int method_length, const char **method)
+{
+   if (method_length < 0) {
+      // No control
+      return OHS_METHOD_ALL;
+   }
+
+   unsigned int method_mask = 0;
+
+   for (int method_index = 0 ; method_index < method_length ; ++method_index) {
+      method_mask |= ohs_method_bit (method [method_index]);
+   }
+   return method_mask;
+}
+
+unsigned int ohs_method_bit (const char *method)
+{
+   // 0 for an unknown method, refused by the configuration and by the routes
+   // which control the method
+   for (int method_index = 0 ; method_index < METHOD_NAME_COUNT ; ++method_index) {
+      if (strcasecmp (method, method_names [method_index].name) == 0) {
+         return method_names [method_index].bit;
+      }
+   }
+   return 0;
+}
+
+struct route_node_struct *route_node_compile (struct url_config_struct *first_config, struct url_config_struct *owner_config, const struct route_node_struct *parent_node)
+{
+   struct route_node_struct *route_node = calloc (1, sizeof (struct route_node_struct));
+
+   if (route_node == NULL) {
+      return NULL;
+   }
+   // Settings of the url level which owns this node, the subroutine, the
+   // maximum body size and the compression are inherited
+   if (owner_config == NULL) {
+      route_node->subr = NULL;
+      route_node->metrics_index = 0;
+      route_node->max_body = config_http_max_body;
+      route_node->compress = config_http_compress_min > 0;
+      route_node->cache_param_length = -1;
+      route_node->method_mask = OHS_METHOD_ALL;
+   }
+   else {
+      route_node->subr = owner_config->subr != NULL ? owner_config->subr : parent_node->subr;
+      route_node->metrics_index = ohs_metrics_subr_index (route_node->subr);
+      route_node->max_body = owner_config->max_body >= 0 ? owner_config->max_body : parent_node->max_body;
+      route_node->compress = owner_config->compress >= 0 ? config_http_compress_min > 0 && owner_config->compress : parent_node->compress;
+      // The cache is only for the level where it's configured
+      route_node->cache_ttl = config_http_cache_max ? owner_config->cache_ttl : 0;
+      route_node->cache_param_length = owner_config->cache_param_length;
+      route_node->cache_param = owner_config->cache_param;
+      route_node->cache_header_length = owner_config->cache_header_length;
+      route_node->cache_header = owner_config->cache_header;
+      route_node->coalesce = owner_config->coalesce;
+      route_node->etag = owner_config->etag;
+      route_node->method_mask = route_method_mask (owner_config->method_length, owner_config->method);
+      if (owner_config->get_param_length >= 0) {
+         route_node->get_param_set = string_set_create (owner_config->get_param_length, owner_config->get_param);
+         if (route_node->get_param_set == NULL) {
+            route_node_free (route_node);
+            return NULL;
+         }
+      }
+   }
+   route_node->has_sub_path = first_config != NULL;
+
+   int literal_length = 0;
+
+   for (struct url_config_struct *url_config = first_config ; url_config != NULL ; url_config = url_config->next) {
+      if (url_config->path != NULL) {
+         ++literal_length;
+      }
+      else {
+         ++route_node->pattern_length;
+      }
+   }
+   if (literal_length) {
+      unsigned int table_size = hash_table_size (literal_length);
+
+      route_node->literal_mask = table_size - 1;
+      route_node->literals = calloc (table_size, sizeof (struct route_literal_struct));
+      if (route_node->literals == NULL) {
+         route_node_free (route_node);
+         return NULL;
+      }
+   }
+   if (route_node->pattern_length) {
+      route_node->patterns = calloc (route_node->pattern_length, sizeof (struct route_pattern_struct));
+      if (route_node->patterns == NULL) {
+         route_node->pattern_length = 0;
+         route_node_free (route_node);
+         return NULL;
+      }
+   }
+
+   int pattern_index = 0;
+
+   for (struct url_config_struct *url_config = first_config ; url_config != NULL ; url_config = url_config->next) {
+      struct route_node_struct *sub_node = route_node_compile (url_config->sub_path, url_config, route_node);
+
+      if (sub_node == NULL) {
+         route_node->pattern_length = pattern_index;
+         route_node_free (route_node);
+         return NULL;
+      }
+      if (url_config->path != NULL) {
+         size_t path_length = strlen (url_config->path);
+         unsigned int hash = hash_nocase (url_config->path, path_length);
+         unsigned int bucket = hash & route_node->literal_mask;
+
+         while (route_node->literals [bucket].node != NULL && !(route_node->literals [bucket].hash == hash && route_node->literals [bucket].path_length == path_length && strcasecmp (route_node->literals [bucket].path, url_config->path) == 0)) {
+            bucket = (bucket + 1) & route_node->literal_mask;
+         }
+         if (route_node->literals [bucket].node != NULL) {
+            // Same path configured twice, the first one is used
+            route_node_free (sub_node);
+         }
+         else {
+            route_node->literals [bucket].path = url_config->path;
+            route_node->literals [bucket].path_length = path_length;
+            route_node->literals [bucket].hash = hash;
+            route_node->literals [bucket].node = sub_node;
+         }
+      }
+      else {
+         route_node->patterns [pattern_index].pattern_comp = url_config->pattern_comp;
+         route_node->patterns [pattern_index].pattern_extra = url_config->pattern_extra;
+         route_node->patterns [pattern_index].node = sub_node;
+         ++pattern_index;
+      }
+   }
+   return route_node;
+}
+
+bool ohs_route_compile ()
+{
+   ohs_route_free ();
+   route_root = route_node_compile (first_url_config, NULL, NULL);
+   if (route_root == NULL) {
+      fprintf (stderr, "Memory full when compile url configuration\n");
+      return false;
+   }
+   return true;
+}
+
+void ohs_route_free ()
+{
+   if (route_root != NULL) {
+      route_node_free (route_root);
+      route_root = NULL;
+   }
+}
+
+int check_folder_pattern (const char* folder_name, size_t folder_length, pcre *pattern_comp, pcre_extra *pattern_extra)
+{
+   int prce_status = pcre_exec (pattern_comp, pattern_extra, folder_name, folder_length, 0, 0, NULL, 0);
 
    if (prce_status < 0) {
       if (prce_status != PCRE_ERROR_NOMATCH) {
@@ -24,6 +314,30 @@ int check_folder_pattern (const char* folder_name, size_t folder_length, pcre *p
    return true;
 }
 
+const struct route_node_struct *route_node_find (const struct route_node_struct *route_node, const char *folder_name, size_t folder_length)
+{
+   // Literal path first then the patterns in configuration order
+   if (route_node->literals != NULL) {
+      unsigned int hash = hash_nocase (folder_name, folder_length);
+      unsigned int bucket = hash & route_node->literal_mask;
+
+      while (route_node->literals [bucket].node != NULL) {
+         const struct route_literal_struct *literal = &route_node->literals [bucket];
+
+         if (literal->hash == hash && literal->path_length == folder_length && strncasecmp (literal->path, folder_name, folder_length) == 0) {
+            return literal->node;
+         }
+         bucket = (bucket + 1) & route_node->literal_mask;
+      }
+   }
+   for (int pattern_index = 0 ; pattern_index < route_node->pattern_length ; ++pattern_index) {
+      if (check_folder_pattern (folder_name, folder_length, route_node->patterns [pattern_index].pattern_comp, route_node->patterns [pattern_index].pattern_extra)) {
+         return route_node->patterns [pattern_index].node;
+      }
+   }
+   return NULL;
+}
+
 int extract_subroutine_name_from_url (const char *url, struct connection_info_struct *connection_info)
 {
    const char* uri_index = url;
@@ -32,70 +346,36 @@ int extract_subroutine_name_from_url (const char *url, struct connection_info_st
    }
    if (*uri_index == '\0') {
       abort_message ("Can't access root path");
-#ifdef OHS_DEBUG
-      printf ("url root path=%s\n", url);
-#endif
+      ohs_log_debug ("url root path=%s", url);
       return MHD_HTTP_NOT_FOUND;
    }
-   struct url_config_struct *base_url_config = first_url_config;
-   while (base_url_config != NULL && *uri_index != '\0') {
+   const struct route_node_struct *route_node = route_root;
+   while (route_node != NULL && route_node->has_sub_path && uri_index != NULL && *uri_index != '\0') {
       // Find next part in url
-      const char *uri_folder_end = strstr (uri_index, "/");
+      const char *uri_folder_end = strchr (uri_index, '/');
       size_t uri_folder_length = uri_folder_end == NULL ? strlen(uri_index) : uri_folder_end - uri_index;
 
-      char *folder_name = strndup (uri_index, uri_folder_length);
-#ifdef OHS_DEBUG
-      printf ("Analyze folder=%s\n", folder_name);
-#endif
+      ohs_log_debug ("Analyze folder=%.*s", (int) uri_folder_length, uri_index);
 
-      if (folder_name == NULL) {
-         abort_message ("Full memory when extract url");
-         return MHD_HTTP_INTERNAL_SERVER_ERROR;
-      }
+      const struct route_node_struct *route_node_found = route_node_find (route_node, uri_index, uri_folder_length);
 
-      struct url_config_struct *url_config_find;
-
-      for (url_config_find = NULL ; url_config_find == NULL && base_url_config != NULL ; base_url_config = base_url_config->next) {
-         if ((base_url_config->path != NULL && strcasecmp (folder_name, base_url_config->path) == 0) ||
-               (base_url_config->pattern_comp != NULL && check_folder_pattern (folder_name, uri_folder_length, base_url_config->pattern_comp))) {
-            url_config_find = base_url_config;
-         }
-      }
-      if (url_config_find == NULL) {
+      if (route_node_found == NULL) {
          char error_message_detail [1024];
 
-         snprintf (error_message_detail, sizeof (error_message_detail), "Folder/file name \"%s\" not found for url \"%s\"", folder_name, url);
+         snprintf (error_message_detail, sizeof (error_message_detail), "Folder/file name \"%.*s\" not found for url \"%s\"", (int) uri_folder_length, uri_index, url);
          abort_message (error_message_detail);
-         free (folder_name);
          return MHD_HTTP_NOT_FOUND;
       }
-#ifdef OHS_DEBUG
-      printf ("Find url config path=%s, sub_path=%p\n", url_config_find->path, url_config_find->sub_path);
-#endif
-      free (folder_name);
       uri_index = uri_folder_end;
       if (uri_index != NULL) {
          while (*uri_index == '/') {
             ++uri_index;
          }
       }
-      base_url_config = url_config_find->sub_path;
-#ifdef OHS_DEBUG
-      if (base_url_config == NULL) {
-         printf ("Last folder in urls\n");
-      }
-      else {
-         printf ("Url can have sub-folder\n");
-      }
-#endif
-
-      if (url_config_find->subr != NULL) {
-         connection_info->subr = url_config_find->subr;
-      }
-      connection_info->method_authorized_length = url_config_find->method_length;
-      connection_info->method_authorized = url_config_find->method;
-      connection_info->get_param_authorized_length = url_config_find->get_param_length;
-      connection_info->get_param_authorized = url_config_find->get_param;
+      route_node = route_node_found;
+      ohs_log_debug (route_node->has_sub_path ? "Url can have sub-folder" : "Last folder in urls");
+      connection_info->subr = route_node->subr;
+      connection_info->route = route_node;
    }
    if (uri_index && *uri_index != '\0') {
       char error_message_detail [1024];
@@ -116,28 +396,18 @@ int extract_subroutine_name_from_url (const char *url, struct connection_info_st
 
 bool check_method_authorized (const char *method, struct connection_info_struct *connection_info)
 {
-   if (connection_info->method_authorized_length < 0) {
+   if (connection_info->route == NULL || connection_info->route->method_mask == OHS_METHOD_ALL) {
       // No control
       return true;
    }
-   for (int method_index = 0 ; method_index < connection_info->method_authorized_length ; ++method_index) {
-      if (strcasecmp (method, connection_info->method_authorized [method_index]) == 0) {
-         return true;
-      }
-   }
-   return false;
+   return (connection_info->route->method_mask & ohs_method_bit (method)) != 0;
 }
 
 bool check_get_param_authorized (const char *key, struct connection_info_struct *connection_info)
 {
-   if (connection_info->get_param_authorized_length < 0) {
+   if (connection_info->route == NULL || connection_info->route->get_param_set == NULL) {
       // No control
       return true;
    }
-   for (int get_param_index = 0 ; get_param_index < connection_info->get_param_authorized_length ; ++get_param_index) {
-      if (strcasecmp (key, connection_info->get_param_authorized [get_param_index]) == 0) {
-         return true;
-      }
-   }
-   return false;
+   return string_set_contains (connection_info->route->get_param_set, key);
 }
@@ -0,0 +1,355 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pcre.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openqm_httpd_server.h"
+
+// Master/worker processes.
+// The master owns the listening socket and only supervises the workers. Each
+// worker accepts on the shared socket with its own MHD daemon and its own
+// OpenQM session, so the kernel dispatches the connections between them.
+
+// Declarations
+
+static void stop_handler (int signal_number);
+static void reopen_handler (int signal_number);
+static void log_level_handler (int signal_number);
+static bool install_stop_handler ();
+static bool listen_nonblock (int listen_fd);
+static void worker_run (int worker_index, int listen_fd, int unix_listen_fd);
+static pid_t worker_spawn (int worker_index, int listen_fd, int unix_listen_fd);
+
+// Constants
+
+static const time_t worker_min_lifetime = 1;
+// Wake up of the worker loop to write the counts of the dropped messages
+static const struct timespec worker_flush_interval = { 1, 0 };
+
+// Globals variables
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t reopen_requested = 0;
+static volatile sig_atomic_t log_level_requested = 0;
+
+// Functions
+
+void stop_handler (int signal_number)
+{
+   stop_requested = 1;
+}
+
+void reopen_handler (int signal_number)
+{
+   reopen_requested = 1;
+}
+
+void log_level_handler (int signal_number)
+{
+   log_level_requested = 1;
+}
+
+bool install_stop_handler ()
+{
+   // Without SA_RESTART, the signals interrupt waitpid in the master. The
+   // workers block them in all their threads and take them with sigtimedwait.
+   struct sigaction stop_action;
+   struct sigaction reopen_action;
+   struct sigaction log_level_action;
+
+   memset (&stop_action, 0, sizeof (stop_action));
+   stop_action.sa_handler = &stop_handler;
+   sigemptyset (&stop_action.sa_mask);
+   memset (&reopen_action, 0, sizeof (reopen_action));
+   reopen_action.sa_handler = &reopen_handler;
+   sigemptyset (&reopen_action.sa_mask);
+   memset (&log_level_action, 0, sizeof (log_level_action));
+   log_level_action.sa_handler = &log_level_handler;
+   sigemptyset (&log_level_action.sa_mask);
+   if (sigaction (SIGTERM, &stop_action, NULL) != 0 || sigaction (SIGINT, &stop_action, NULL) != 0
+       || sigaction (SIGUSR1, &reopen_action, NULL) != 0 || sigaction (SIGUSR2, &log_level_action, NULL) != 0) {
+      perror ("sigaction");
+      return false;
+   }
+   return true;
+}
+
+int ohs_listen_socket (int port)
+{
+   int listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+
+   if (listen_fd < 0) {
+      perror ("socket");
+      return -1;
+   }
+
+   int reuse_addr = 1;
+   struct sockaddr_in listen_addr;
+
+   setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof (reuse_addr));
+   // Inherited by the accepted connections
+   if (config_http_tcp_nodelay) {
+      int tcp_nodelay = 1;
+
+      setsockopt (listen_fd, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof (tcp_nodelay));
+   }
+   if (config_http_tcp_fastopen > 0 && setsockopt (listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &config_http_tcp_fastopen, sizeof (config_http_tcp_fastopen)) != 0) {
+      fprintf (stderr, "Can't enable TCP fast open: %s\n", strerror (errno));
+   }
+   memset (&listen_addr, 0, sizeof (listen_addr));
+   listen_addr.sin_family = AF_INET;
+   listen_addr.sin_addr.s_addr = htonl (INADDR_ANY);
+   listen_addr.sin_port = htons (port);
+   if (bind (listen_fd, (struct sockaddr *) &listen_addr, sizeof (listen_addr)) != 0) {
+      fprintf (stderr, "Can't bind port %d: %s\n", port, strerror (errno));
+      close (listen_fd);
+      return -1;
+   }
+   if (!listen_nonblock (listen_fd)) {
+      close (listen_fd);
+      return -1;
+   }
+   return listen_fd;
+}
+
+int ohs_listen_unix_socket (const char *socket_path, mode_t socket_mode)
+{
+   struct sockaddr_un listen_addr;
+
+   if (strlen (socket_path) >= sizeof (listen_addr.sun_path)) {
+      fprintf (stderr, "Socket path %s too long\n", socket_path);
+      return -1;
+   }
+
+   int listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+   if (listen_fd < 0) {
+      perror ("socket");
+      return -1;
+   }
+   memset (&listen_addr, 0, sizeof (listen_addr));
+   listen_addr.sun_family = AF_UNIX;
+   strcpy (listen_addr.sun_path, socket_path);
+   // Left by a previous run which didn't stop properly
+   unlink (socket_path);
+   if (bind (listen_fd, (struct sockaddr *) &listen_addr, sizeof (listen_addr)) != 0) {
+      fprintf (stderr, "Can't bind socket %s: %s\n", socket_path, strerror (errno));
+      close (listen_fd);
+      return -1;
+   }
+   if (chmod (socket_path, socket_mode) != 0) {
+      fprintf (stderr, "Can't change mode of socket %s: %s\n", socket_path, strerror (errno));
+      close (listen_fd);
+      unlink (socket_path);
+      return -1;
+   }
+   if (!listen_nonblock (listen_fd)) {
+      close (listen_fd);
+      unlink (socket_path);
+      return -1;
+   }
+   return listen_fd;
+}
+
+bool listen_nonblock (int listen_fd)
+{
+   if (listen (listen_fd, config_http_listen_backlog) != 0) {
+      perror ("listen");
+      return false;
+   }
+   // Workers share the socket, the ones losing the accept race must not block
+   fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK);
+   return true;
+}
+
+void worker_run (int worker_index, int listen_fd, int unix_listen_fd)
+{
+   sigset_t stop_mask;
+
+   // The signals are only taken by the loop below, the threads started
+   // below inherit the mask so QMCall and MHD are never interrupted
+   sigemptyset (&stop_mask);
+   sigaddset (&stop_mask, SIGTERM);
+   sigaddset (&stop_mask, SIGINT);
+   sigaddset (&stop_mask, SIGUSR1);
+   sigaddset (&stop_mask, SIGUSR2);
+   sigprocmask (SIG_BLOCK, &stop_mask, NULL);
+
+   ohs_metrics_worker (worker_index);
+   if (!ohs_accesslog_start (worker_index)) {
+      exit (1);
+   }
+   ohs_pool_init ();
+   if (!ohs_executor_start ()) {
+      ohs_accesslog_stop ();
+      ohs_pool_free ();
+      exit (1);
+   }
+
+   // One daemon by listening socket, they share the executor
+   struct MHD_Daemon *daemon = ohs_start_daemon (listen_fd);
+   struct MHD_Daemon *unix_daemon = daemon == NULL || unix_listen_fd < 0 ? NULL : ohs_start_daemon (unix_listen_fd);
+
+   if (daemon == NULL || (unix_listen_fd >= 0 && unix_daemon == NULL)) {
+      abort_message ("Worker can't start http daemon");
+      if (daemon != NULL) {
+         MHD_stop_daemon (daemon);
+      }
+      ohs_executor_stop ();
+      ohs_accesslog_stop ();
+      ohs_pool_free ();
+      exit (1);
+   }
+   ohs_log_debug ("Worker %d started", (int) getpid ());
+   while (!stop_requested) {
+      int signal_number = sigtimedwait (&stop_mask, NULL, &worker_flush_interval);
+
+      if (signal_number == SIGTERM || signal_number == SIGINT) {
+         stop_requested = 1;
+      }
+      else if (signal_number == SIGUSR1) {
+         // Forwarded by the master after a rotation of the access log
+         ohs_accesslog_reopen ();
+      }
+      else if (signal_number == SIGUSR2) {
+         // Forwarded by the master, which has switched its level too
+         ohs_log_toggle ();
+      }
+      ohs_log_rate_flush ();
+   }
+   // Stop accepting, finish the queued calls then close the connections
+   MHD_quiesce_daemon (daemon);
+   if (unix_daemon != NULL) {
+      MHD_quiesce_daemon (unix_daemon);
+   }
+   ohs_executor_stop ();
+   MHD_stop_daemon (daemon);
+   if (unix_daemon != NULL) {
+      MHD_stop_daemon (unix_daemon);
+   }
+   ohs_accesslog_stop ();
+   ohs_cache_free ();
+   ohs_buffer_log_stats ();
+   ohs_buffer_free ();
+   ohs_pool_free ();
+   ohs_config_free ();
+   config_destroy (&config_openqm_httpd_server);
+   exit (0);
+}
+
+pid_t worker_spawn (int worker_index, int listen_fd, int unix_listen_fd)
+{
+   pid_t worker_pid = fork ();
+
+   if (worker_pid == 0) {
+      worker_run (worker_index, listen_fd, unix_listen_fd);
+   }
+   else if (worker_pid < 0) {
+      char error_message_detail [128];
+
+      snprintf (error_message_detail, sizeof (error_message_detail), "Can't fork worker: %s", strerror (errno));
+      abort_message (error_message_detail);
+   }
+   return worker_pid;
+}
+
+int ohs_master_run (int listen_fd, int unix_listen_fd)
+{
+   pid_t *worker_pids = calloc (config_http_workers, sizeof (pid_t));
+   time_t *worker_starts = calloc (config_http_workers, sizeof (time_t));
+
+   if (worker_pids == NULL || worker_starts == NULL || !install_stop_handler ()) {
+      free (worker_pids);
+      free (worker_starts);
+      return 1;
+   }
+   for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+      worker_pids [worker_index] = worker_spawn (worker_index, listen_fd, unix_listen_fd);
+      worker_starts [worker_index] = time (NULL);
+   }
+
+   // Respawn the workers which exit until the master is asked to stop
+   while (!stop_requested) {
+      int worker_status;
+      pid_t worker_pid = waitpid (-1, &worker_status, 0);
+
+      if (worker_pid < 0) {
+         if (errno == ECHILD) {
+            sleep (worker_min_lifetime);
+         }
+      }
+      if (reopen_requested) {
+         // Rotation of the access log, each worker reopens its file
+         reopen_requested = 0;
+         for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+            if (worker_pids [worker_index] > 0) {
+               kill (worker_pids [worker_index], SIGUSR1);
+            }
+         }
+      }
+      if (log_level_requested) {
+         // The master switches its level, the workers do the same
+         log_level_requested = 0;
+         ohs_log_toggle ();
+         for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+            if (worker_pids [worker_index] > 0) {
+               kill (worker_pids [worker_index], SIGUSR2);
+            }
+         }
+         ohs_log (LOG_NOTICE, "Log level %s", ohs_log_level == LOG_DEBUG ? "debug" : "configured");
+      }
+      for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+         if (stop_requested) {
+            break;
+         }
+         if (worker_pid > 0 && worker_pids [worker_index] == worker_pid) {
+            char error_message_detail [128];
+
+            snprintf (error_message_detail, sizeof (error_message_detail), "Worker %d exited with status %d, respawning", (int) worker_pid, worker_status);
+            abort_message (error_message_detail);
+            worker_pids [worker_index] = -1;
+         }
+         if (worker_pids [worker_index] < 0) {
+            // Avoid a fork loop when a worker dies at startup
+            if (time (NULL) - worker_starts [worker_index] < worker_min_lifetime) {
+               sleep (worker_min_lifetime);
+            }
+            worker_pids [worker_index] = worker_spawn (worker_index, listen_fd, unix_listen_fd);
+            worker_starts [worker_index] = time (NULL);
+         }
+      }
+   }
+
+   // Stop and wait all workers
+   for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+      if (worker_pids [worker_index] > 0) {
+         kill (worker_pids [worker_index], SIGTERM);
+      }
+   }
+   for (int worker_index = 0 ; worker_index < config_http_workers ; ++worker_index) {
+      if (worker_pids [worker_index] > 0) {
+         while (waitpid (worker_pids [worker_index], NULL, 0) < 0 && errno == EINTR) {
+         }
+      }
+   }
+   free (worker_pids);
+   free (worker_starts);
+   return 0;
+}
@@ -0,0 +1,90 @@
+#include <libconfig.h>
+#include <microhttpd.h>
+#include <pcre.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "../openqm_httpd_server.h"
+
+// Test of the method control of the compiled routes, linked with
+// openqm_httpd_server_url.o only. The symbols of the other modules used by
+// the routing are defined here.
+
+// Declarations
+
+static void test_method (const char *url, const char *method, bool authorized);
+
+// Globals variables
+
+volatile int ohs_log_level = LOG_ERR;
+size_t config_http_cache_max = 0;
+int config_http_compress_min = 0;
+int config_http_max_body = 1048576;
+struct url_config_struct *first_url_config = NULL;
+static int test_failures = 0;
+
+// Functions
+
+void abort_message (const char *error_message)
+{
+}
+
+void ohs_log (int level, const char *format, ...)
+{
+}
+
+int ohs_metrics_subr_index (const char *subr)
+{
+   return 0;
+}
+
+void test_method (const char *url, const char *method, bool authorized)
+{
+   struct connection_info_struct connection_info;
+
+   memset (&connection_info, 0, sizeof (connection_info));
+   if (extract_subroutine_name_from_url (url, &connection_info) != 0) {
+      fprintf (stderr, "FAIL %s not routed\n", url);
+      ++test_failures;
+   }
+   else if (check_method_authorized (method, &connection_info) != authorized) {
+      fprintf (stderr, "FAIL %s %s %s\n", method, url, authorized ? "refused" : "accepted");
+      ++test_failures;
+   }
+}
+
+int main ()
+{
+   const char *head_methods [] = { "GET", "HEAD" };
+   const char *options_methods [] = { "OPTIONS" };
+   struct url_config_struct options_config = { .path = "options", .subr = "OPTIONS.SUBR", .max_body = -1, .compress = -1, .cache_param_length = -1, .cache_header_length = -1, .method_length = 1, .method = options_methods, .get_param_length = -1 };
+   struct url_config_struct head_config = { .path = "head", .subr = "HEAD.SUBR", .max_body = -1, .compress = -1, .cache_param_length = -1, .cache_header_length = -1, .method_length = 2, .method = head_methods, .get_param_length = -1, .next = &options_config };
+   struct url_config_struct any_config = { .path = "any", .subr = "ANY.SUBR", .max_body = -1, .compress = -1, .cache_param_length = -1, .cache_header_length = -1, .method_length = -1, .get_param_length = -1, .next = &head_config };
+
+   first_url_config = &any_config;
+   if (!ohs_route_compile ()) {
+      return 1;
+   }
+   test_method ("/head", "HEAD", true);
+   test_method ("/head", "head", true);
+   test_method ("/head", "GET", true);
+   test_method ("/head", "POST", false);
+   test_method ("/head", "OPTIONS", false);
+   test_method ("/options", "OPTIONS", true);
+   test_method ("/options", "GET", false);
+   test_method ("/options", "PROPFIND", false);
+   test_method ("/any", "PROPFIND", true);
+   test_method ("/any", "HEAD", true);
+   if (ohs_method_bit ("PROPFIND") != 0 || ohs_method_bit ("TRACE") == 0) {
+      fprintf (stderr, "FAIL method bits\n");
+      ++test_failures;
+   }
+   ohs_route_free ();
+   if (test_failures == 0) {
+      printf ("OK\n");
+   }
+   return test_failures != 0;
+}